@@ -46,6 +46,7 @@
  * brightness setting when the program exits
  */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -55,9 +56,44 @@
 #include <argp.h>
 #include <math.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <glob.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <linux/futex.h>
 
-#define BRIGHTNESS "/sys/class/backlight/intel_backlight/brightness"
-#define MAX_BRIGHTNESS "/sys/class/backlight/intel_backlight/max_brightness"
+#define DEVICE_DIR "/sys/class/backlight/intel_backlight/"
+#define THERMAL_DIR "/sys/class/thermal"
+#define POWER_DIR "/sys/class/power_supply"
+#define SOCKET_FILE "/tmp/brightSOCK"
+#define STATE_DIR "/var/lib/backlight/"
+#define LOCK_PREFIX "/tmp/brightLOCK"
+#define MAX_DEVICES 8
+#define BL_POWER_ON  0
+#define BL_POWER_OFF 4 /* FB_BLANK_POWERDOWN */
+#define METRICS_FILE "/tmp/brightMETRICS"
+#define METRICS_MAGIC 0x626c6d31
+#define RING_FILE "/run/brightRING"
+#define GDBUS "/usr/bin/gdbus"
+#define INHIBIT "/usr/bin/systemd-inhibit"
+#define CAT "/usr/bin/cat"
+#define RING_MAGIC 0x626c7231
+#define RING_SIZE 256 /* must be a power of two */
 /**
  * Stores the values of the program options that are passed
  * in from the command line. The values initially set to invalid values by
@@ -74,10 +110,62 @@ typedef struct {
 	int inc;        /**< Value by which to increment the brightness */
 	int dec;        /**< Value by which to decrement the brightness */
 	int set;        /**< Value by which to set the brightness */
+	char *metrics;  /**< If set, export Prometheus metrics to this file */
+	char *device[MAX_DEVICES]; /**< Backlight directories */
+	int devices;    /**< Number of -D given, 0 for DEVICE_DIR */
+	char *record;   /**< If set, append each request to this trace */
+	char *replay;   /**< If set, replay this trace instead */
+	double speed;   /**< Replay speed multiplier */
+	int profile;    /**< If set, print perf counters for each phase */
+	int thermal;    /**< If set, keep running and cap when hot */
+	char *thermaldir; /**< Thermal zone directory, NULL for THERMAL_DIR */
+	int daemon;     /**< If set, serve requests on SOCKET_FILE */
+	int client;     /**< If set, pass the request to the daemon */
+	int idle;       /**< If set, the daemon dims when logind says idle */
+	char *bus;      /**< D-Bus address of logind, NULL for the system bus */
+	int follow;     /**< If set, print the daemon's changes as they happen */
+	int dither;     /**< If set, the daemon dithers between raw levels */
+	int stress;     /**< Seconds to load the daemon for with -c, 0 if not */
 } ProgramArguments;
 
 static ProgramArguments arguments;
 
+/*
+ * set when installed setuid root and run by someone else, who must not be
+ * able to have root write files of their choosing
+ */
+static int elevated;
+
+/* keys for options that only have a long form */
+enum { OPT_RECORD = 256, OPT_REPLAY, OPT_SPEED, OPT_PROFILE, OPT_THERMAL,
+       OPT_THERMAL_DIR, OPT_DAEMON, OPT_IDLE, OPT_BUS, OPT_FOLLOW,
+       OPT_DITHER, OPT_STRESS };
+
+/**
+ * Paths to the files of the backlight device being driven. Any directory
+ * laid out like a sysfs backlight will do, which lets a plain directory
+ * with two text files stand in for the hardware.
+ */
+typedef struct {
+	char dir[PATH_MAX - 32];       /**< directory, with a trailing slash */
+	char brightness[PATH_MAX];     /**< the brightness file */
+	char max_brightness[PATH_MAX]; /**< the max_brightness file */
+	char bl_power[PATH_MAX];       /**< the bl_power file, if any */
+	char actual[PATH_MAX];         /**< the actual_brightness file */
+	int  observed;                 /**< last value read back from it */
+	int  cached;                   /**< value the device is known to hold,
+	                                    -1 if unknown */
+	unsigned long elided;          /**< writes skipped as it held the value */
+	int  yielded;                  /**< set if a fade gave way to a change
+	                                    made by someone else */
+	char lock[PATH_MAX];           /**< its lock file, named after the
+	                                    directory with links resolved */
+	int  lockfd;                   /**< open lock file, -1 until needed */
+} Device;
+
+static Device device;
+static Device others[MAX_DEVICES - 1]; /**< any further -D, in order */
+
 /// Define the acceptable command line options
 
 static struct argp_option options[] =
@@ -91,6 +179,22 @@ static struct argp_option options[] =
 	{"inc", 'i', "INT",0,"Increment"},
 	{"dec", 'd', "INT",0,"Decrement"},
 	{"set", 's', "INT",0,"Set"},
+	{"metrics", 'm', "FILE",0,"Export Prometheus metrics to FILE"},
+	{"device",  'D', "DIR", 0,"Backlight device directory, may be repeated"},
+	{"record", OPT_RECORD, "FILE",0,"Append each request to the trace FILE"},
+	{"replay", OPT_REPLAY, "FILE",0,"Replay the trace FILE against the device"},
+	{"speed",  OPT_SPEED,  "X",   0,"Replay X times faster than recorded"},
+	{"profile", OPT_PROFILE, 0,   0,"Print perf counters for each phase"},
+	{"thermal", OPT_THERMAL, 0,   0,"Keep running, capping brightness when hot"},
+	{"thermal-dir", OPT_THERMAL_DIR, "DIR",0,"Thermal zone directory"},
+	{"daemon",  OPT_DAEMON, 0,    0,"Keep running, serving requests on a socket"},
+	{"client",  'c', 0, 0, "Send the request to the daemon"},
+	{"idle",    OPT_IDLE, 0,      0,"Dim while logind reports the session idle"},
+	{"bus",     OPT_BUS, "ADDRESS",0,"D-Bus address to find logind on"},
+	{"follow",  OPT_FOLLOW, 0,    0,"Print the daemon's changes as they happen"},
+	{"dither",  OPT_DITHER, 0,    0,"Dither between raw levels in the daemon"},
+	{"stress",  OPT_STRESS, "SECONDS",0,"With -c, report fade step jitter with "
+	                                    "and without client load"},
 	{0}
 };
 
@@ -133,6 +237,551 @@ static const int fade_time = 170;
  */
 static const int lower_limit = 1;
 
+/*
+ * when the device has bl_power, toggle switches the panel off with it and
+ * leaves the brightness alone. set this to fade down first, the brightness
+ * is put back once the panel is off
+ * 0 = switch off instantly
+ */
+static const int toggle_fade = 1;
+
+/*
+ * --thermal caps the brightness at thermal_cap percent while the hottest
+ * thermal zone is at or above thermal_cap_temp, and lifts the cap once it
+ * has cooled to thermal_release_temp. temperatures are in millidegrees C.
+ * zones are checked on every thermal uevent and every thermal_poll_ms
+ */
+static const int thermal_cap_temp     = 80000;
+static const int thermal_release_temp = 72000;
+static const int thermal_cap          = 40;
+static const int thermal_poll_ms      = 2000;
+
+/*
+ * with --idle the daemon fades to idle_level percent once logind has
+ * reported the session idle for idle_delay seconds, and jumps straight back
+ * on activity. use --bus to follow a logind other than the system one
+ */
+static const int idle_level = 10;
+static const int idle_delay = 30;
+
+/*
+ * gdbus is restarted logind_retry seconds after it exits. Each run that
+ * never got as far as printing anything doubles the wait, up to
+ * logind_retry_max, and its complaints are only shown the first time
+ */
+static const int logind_retry = 5;
+static const int logind_retry_max = 300;
+
+/*
+ * in the daemon a manual change overrides what the schedule and ambient
+ * sources ask for during manual_override seconds, then they take over again
+ */
+static const int manual_override = 300;
+
+/*
+ * token buckets limiting how fast the daemon takes level requests, per
+ * connection and per source: a rate in requests a second and a burst.
+ * Requests over a limit are held, only the newest one of each source kept,
+ * and passed on once the bucket allows
+ */
+static const double client_rate = 20, client_burst = 10;
+static const double source_rate = 50, source_burst = 20;
+
+/*
+ * with --dither the daemon works in 1/dither_scale steps of a raw level
+ * and shows the ones in between by alternating between the two raw levels
+ * either side, dither_hz times a second. If the fade thread uses more than
+ * dither_cpu_limit of a CPU it halves the rate, down to dither_min_hz, and
+ * below that stops dithering. Each doubling back takes dither_calm seconds
+ * in a row under half the limit. It never dithers on battery, which the
+ * main thread checks every power_poll_ms
+ */
+static const int dither_scale = 16;
+static const int dither_hz = 240;
+static const int dither_min_hz = 60;
+static const double dither_cpu_limit = 0.01;
+static const int dither_calm = 3;
+static const int power_poll_ms = 1000;
+
+/*
+ * metrics are kept in a small file mapped into every invocation, so counters
+ * accumulate across runs and concurrent runs can update them without taking
+ * the brightness lock. -m renders them in Prometheus text format, e.g. into
+ * node_exporter's textfile collector directory
+ */
+
+/* histogram bucket upper bounds in microseconds, +Inf is implied */
+static const unsigned long metric_buckets[] =
+	{100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000};
+#define METRIC_BUCKETS (sizeof(metric_buckets)/sizeof(*metric_buckets))
+
+/**
+ * A Prometheus style histogram. Buckets are stored non-cumulatively and
+ * summed when rendered so an observation only touches one of them.
+ */
+typedef struct {
+	unsigned long bucket[METRIC_BUCKETS + 1]; /**< last bucket is +Inf */
+	unsigned long sum;                        /**< in microseconds */
+	unsigned long count;
+} Histogram;
+
+enum { REQ_READ, REQ_SET, REQ_INC, REQ_DEC, REQ_TOGGLE, REQ_TYPES };
+static const char *request_names[REQ_TYPES] =
+	{"read", "set", "inc", "dec", "toggle"};
+
+enum { ERR_LOCK, ERR_OPEN, ERR_WRITE, ERR_SLEEP, ERR_TYPES };
+static const char *error_names[ERR_TYPES] =
+	{"lock", "open", "write", "sleep"};
+
+enum { LIMIT_CLIENT, LIMIT_SOURCE, LIMIT_TYPES };
+static const char *limit_names[LIMIT_TYPES] = {"client", "source"};
+
+/**
+ * Layout of the shared metrics file. Only ever updated with atomic adds.
+ */
+typedef struct {
+	unsigned int  magic;                 /**< METRICS_MAGIC once set up */
+	unsigned long requests[REQ_TYPES];   /**< requests handled by type */
+	unsigned long errors[ERR_TYPES];     /**< failures by error code */
+	unsigned long elided;                /**< writes of a value already held */
+	unsigned long throttled[LIMIT_TYPES];/**< daemon requests held back */
+	unsigned long coalesced;             /**< held requests superseded */
+	Histogram     lock_wait;             /**< time spent waiting for lock */
+	Histogram     sysfs_write;           /**< latency of each sysfs write */
+	Histogram     fade_overrun;          /**< fade time beyond fade_time */
+	Histogram     notification;          /**< time spent in notify-send */
+	Histogram     step_jitter;           /**< lateness of daemon fade steps */
+	Histogram     resume_restore;        /**< resume to level restored */
+	Histogram     dither_cpu;            /**< fade thread CPU a second */
+} Metrics;
+
+static Metrics *metrics;
+
+static void
+MetricAdd(unsigned long *counter, unsigned long value)
+{
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static void
+HistogramObserve(Histogram *hist, unsigned long us)
+{
+	unsigned int i = 0;
+	while(i < METRIC_BUCKETS && us > metric_buckets[i])
+		i++;
+	MetricAdd(&hist->bucket[i], 1);
+	MetricAdd(&hist->sum, us);
+	MetricAdd(&hist->count, 1);
+}
+
+static unsigned long
+ElapsedUs(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec)*1000000UL
+	     + (now.tv_nsec - since->tv_nsec)/1000;
+}
+
+
+/*
+ * --profile reads a set of perf_event_open counters at the end of each phase
+ * of a run. Counters the kernel or perf_event_paranoid refuse are left out
+ */
+
+enum { PERF_TASK_CLOCK, PERF_SWITCHES, PERF_FAULTS, PERF_INSTRUCTIONS,
+       PERF_SYSCALLS, PERF_COUNTERS };
+static const char *perf_names[PERF_COUNTERS] =
+	{"task-clock(us)", "ctx-switches", "faults", "instructions", "syscalls"};
+
+#define PROFILE_PHASES 8
+
+/**
+ * Counter values at the end of each phase of a profiled run
+ */
+typedef struct {
+	int fd[PERF_COUNTERS];                   /**< -1 if unavailable */
+	unsigned long long last[PERF_COUNTERS];  /**< values at the last mark */
+	struct timespec lastTime;                /**< time of the last mark */
+	int phases;                              /**< phases marked so far */
+	const char *name[PROFILE_PHASES];
+	unsigned long us[PROFILE_PHASES];        /**< wall time of each phase */
+	unsigned long long delta[PROFILE_PHASES][PERF_COUNTERS];
+} Profile;
+
+static Profile profile;
+
+static int
+PerfOpen(unsigned int type, unsigned long long config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size   = sizeof(attr);
+	attr.type   = type;
+	attr.config = config;
+	
+	int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if(fd == -1)
+	{
+		/* a restrictive perf_event_paranoid may still allow user space */
+		attr.exclude_kernel = 1;
+		attr.exclude_hv     = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+		             PERF_FLAG_FD_CLOEXEC);
+	}
+	return fd;
+}
+
+void
+ProfileStart(Profile *prof)
+{
+	/**
+	 * Open the counters and start timing the first phase
+	 *
+	 * @param[out] *prof The profile to start
+	 */
+
+	int i, id;
+	
+	prof->fd[PERF_TASK_CLOCK] = PerfOpen(PERF_TYPE_SOFTWARE,
+	                                     PERF_COUNT_SW_TASK_CLOCK);
+	prof->fd[PERF_SWITCHES] = PerfOpen(PERF_TYPE_SOFTWARE,
+	                                   PERF_COUNT_SW_CONTEXT_SWITCHES);
+	prof->fd[PERF_FAULTS] = PerfOpen(PERF_TYPE_SOFTWARE,
+	                                 PERF_COUNT_SW_PAGE_FAULTS);
+	prof->fd[PERF_INSTRUCTIONS] = PerfOpen(PERF_TYPE_HARDWARE,
+	                                       PERF_COUNT_HW_INSTRUCTIONS);
+	
+	/* there is no syscall counter, count entries to the syscall tracepoint */
+	FILE *theFile = fopen("/sys/kernel/tracing/events/raw_syscalls/"
+	                      "sys_enter/id", "r");
+	if(!theFile || fscanf(theFile, "%i", &id) != 1)
+		id = -1;
+	if(theFile)
+		fclose(theFile);
+	prof->fd[PERF_SYSCALLS] = id < 0 ? -1 : PerfOpen(PERF_TYPE_TRACEPOINT, id);
+	
+	for(i = 0; i < PERF_COUNTERS; i++)
+		if(prof->fd[i] == -1
+		|| read(prof->fd[i], &prof->last[i], sizeof(prof->last[i])) < 1)
+			prof->last[i] = 0;
+	prof->phases = 0;
+	clock_gettime(CLOCK_MONOTONIC, &prof->lastTime);
+}
+
+void
+ProfileMark(Profile *prof, const char *phase)
+{
+	/**
+	 * End the current phase, storing how much each counter moved during it.
+	 * Does nothing unless the profile has been started.
+	 *
+	 * @param[in,out] *prof  The profile
+	 * @param[in]     *phase The name of the phase that just ended
+	 */
+
+	int i;
+	unsigned long long value;
+	
+	if(!arguments.profile || prof->phases == PROFILE_PHASES)
+		return;
+	prof->us[prof->phases] = ElapsedUs(&prof->lastTime);
+	for(i = 0; i < PERF_COUNTERS; i++)
+	{
+		if(prof->fd[i] == -1
+		|| read(prof->fd[i], &value, sizeof(value)) != sizeof(value))
+			continue;
+		prof->delta[prof->phases][i] = value - prof->last[i];
+		prof->last[i] = value;
+	}
+	prof->name[prof->phases++] = phase;
+	clock_gettime(CLOCK_MONOTONIC, &prof->lastTime);
+}
+
+void
+ProfilePrint(Profile *prof)
+{
+	/**
+	 * Print a table of the phases and their counters and close the counters
+	 *
+	 * @param[in,out] *prof The profile
+	 */
+
+	int i, phase;
+	
+	printf("%-8s %10s", "Phase", "wall(us)");
+	for(i = 0; i < PERF_COUNTERS; i++)
+		printf(" %14s", perf_names[i]);
+	printf("\n");
+	for(phase = 0; phase < prof->phases; phase++)
+	{
+		printf("%-8s %10lu", prof->name[phase], prof->us[phase]);
+		for(i = 0; i < PERF_COUNTERS; i++)
+		{
+			if(prof->fd[i] == -1)
+				printf(" %14s", "-");
+			else if(i == PERF_TASK_CLOCK)
+				printf(" %14llu", prof->delta[phase][i]/1000);
+			else
+				printf(" %14llu", prof->delta[phase][i]);
+		}
+		printf("\n");
+	}
+	for(i = 0; i < PERF_COUNTERS; i++)
+		if(prof->fd[i] != -1)
+			close(prof->fd[i]);
+}
+
+Metrics *
+MetricsOpen(char *theFileName)
+{
+	/**
+	 * Map the shared metrics file, creating it if needed. A file with a
+	 * different layout is cleared. If the file cannot be mapped, a private
+	 * copy is used so callers never have to check.
+	 *
+	 * @param[in] *theFileName A zero terminated string containing the name
+	 *                         and path of the metrics file
+	 *
+	 * @return                 a pointer to the metrics, never NULL
+	 */
+
+	static Metrics fallback;
+	struct stat st;
+	
+	int fd = open(theFileName, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0644);
+	if(fd == -1)
+		return &fallback;
+	if(fstat(fd, &st) == -1
+	|| (st.st_size != sizeof(Metrics)
+	    && (ftruncate(fd, 0) == -1 || ftruncate(fd, sizeof(Metrics)) == -1)))
+	{
+		close(fd);
+		return &fallback;
+	}
+	Metrics *m = mmap(NULL, sizeof(Metrics), PROT_READ|PROT_WRITE,
+	                  MAP_SHARED, fd, 0);
+	close(fd);
+	if(m == MAP_FAILED)
+		return &fallback;
+	
+	unsigned int fresh = 0;
+	if(!__atomic_compare_exchange_n(&m->magic, &fresh, METRICS_MAGIC, 0,
+	                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+	&& fresh != METRICS_MAGIC)
+	{
+		memset(m, 0, sizeof(Metrics));
+		m->magic = METRICS_MAGIC;
+	}
+	return m;
+}
+
+static void
+PrintHistogram(FILE *theFile, const char *name, const char *help,
+               const Histogram *hist)
+{
+	unsigned long total = 0;
+	unsigned int i;
+	
+	fprintf(theFile, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for(i = 0; i < METRIC_BUCKETS; i++)
+	{
+		total += __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED);
+		fprintf(theFile, "%s_bucket{le=\"%g\"} %lu\n",
+		        name, metric_buckets[i]/1e6, total);
+	}
+	total += __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED);
+	fprintf(theFile, "%s_bucket{le=\"+Inf\"} %lu\n", name, total);
+	fprintf(theFile, "%s_sum %g\n", name,
+	        __atomic_load_n(&hist->sum, __ATOMIC_RELAXED)/1e6);
+	fprintf(theFile, "%s_count %lu\n", name,
+	        __atomic_load_n(&hist->count, __ATOMIC_RELAXED));
+}
+
+void
+PrintMetrics(FILE *theFile, const Metrics *m)
+{
+	/**
+	 * Render the metrics in the Prometheus text exposition format
+	 *
+	 * @param[in] *theFile The stream to write to
+	 * @param[in] *m       The metrics to render
+	 */
+
+	int i;
+	
+	fprintf(theFile, "# HELP backlight_requests_total Requests handled, "
+	                 "by type.\n# TYPE backlight_requests_total counter\n");
+	for(i = 0; i < REQ_TYPES; i++)
+		fprintf(theFile, "backlight_requests_total{type=\"%s\"} %lu\n",
+		        request_names[i],
+		        __atomic_load_n(&m->requests[i], __ATOMIC_RELAXED));
+	
+	fprintf(theFile, "# HELP backlight_errors_total Failed requests, "
+	                 "by error.\n# TYPE backlight_errors_total counter\n");
+	for(i = 0; i < ERR_TYPES; i++)
+		fprintf(theFile, "backlight_errors_total{code=\"%s\"} %lu\n",
+		        error_names[i],
+		        __atomic_load_n(&m->errors[i], __ATOMIC_RELAXED));
+	
+	fprintf(theFile, "# HELP backlight_sysfs_writes_elided_total Writes "
+	                 "skipped as the device already held the value.\n"
+	                 "# TYPE backlight_sysfs_writes_elided_total counter\n"
+	                 "backlight_sysfs_writes_elided_total %lu\n",
+	        __atomic_load_n(&m->elided, __ATOMIC_RELAXED));
+	
+	fprintf(theFile, "# HELP backlight_requests_throttled_total Daemon "
+	                 "requests held back, by the limit they hit.\n"
+	                 "# TYPE backlight_requests_throttled_total counter\n");
+	for(i = 0; i < LIMIT_TYPES; i++)
+		fprintf(theFile, "backlight_requests_throttled_total{limit=\"%s\"} "
+		        "%lu\n", limit_names[i],
+		        __atomic_load_n(&m->throttled[i], __ATOMIC_RELAXED));
+	fprintf(theFile, "# HELP backlight_requests_coalesced_total Held back "
+	                 "requests replaced by a newer one.\n"
+	                 "# TYPE backlight_requests_coalesced_total counter\n"
+	                 "backlight_requests_coalesced_total %lu\n",
+	        __atomic_load_n(&m->coalesced, __ATOMIC_RELAXED));
+	
+	PrintHistogram(theFile, "backlight_lock_wait_seconds",
+	               "Time spent waiting for the brightness lock.",
+	               &m->lock_wait);
+	PrintHistogram(theFile, "backlight_sysfs_write_seconds",
+	               "Latency of a single write to the brightness file.",
+	               &m->sysfs_write);
+	PrintHistogram(theFile, "backlight_fade_overrun_seconds",
+	               "Time a fade took beyond the configured fade time.",
+	               &m->fade_overrun);
+	PrintHistogram(theFile, "backlight_notification_seconds",
+	               "Time spent sending the desktop notification.",
+	               &m->notification);
+	PrintHistogram(theFile, "backlight_fade_step_jitter_seconds",
+	               "How late the daemon wrote each fade step.",
+	               &m->step_jitter);
+	PrintHistogram(theFile, "backlight_resume_restore_seconds",
+	               "Time from resume until the level was restored.",
+	               &m->resume_restore);
+	PrintHistogram(theFile, "backlight_dither_cpu_seconds",
+	               "CPU time the fade thread used per second of dithering.",
+	               &m->dither_cpu);
+}
+
+int
+WriteMetrics(char *theFileName, const Metrics *m)
+{
+	/**
+	 * Write the metrics to theFileName. The file is written next to its
+	 * final name and renamed into place so a scraper never sees half of it.
+	 *
+	 * @param[in] *theFileName A zero terminated string containing the name
+	 *                         and path of the textfile to write
+	 * @param[in] *m           The metrics to render
+	 *
+	 * @return                 0 is success; negative integer is failure
+	 */
+
+	char tmpname[PATH_MAX];
+	if(snprintf(tmpname, sizeof(tmpname), "%s.tmp", theFileName)
+	   >= (int)sizeof(tmpname))
+		return -1;
+	
+	FILE *theFile = fopen(tmpname, "w");
+	if(!theFile)
+		return -1;
+	PrintMetrics(theFile, m);
+	if(fclose(theFile) || rename(tmpname, theFileName))
+	{
+		unlink(tmpname);
+		return -2;
+	}
+	return 0;
+}
+
+int
+DevicePath(const char *dir, const char *prefix, char *path, size_t size)
+{
+	/**
+	 * Work out the name of a file kept for a device: prefix followed by the
+	 * device directory with each / turned into _.
+	 *
+	 * @param[in]  *dir    The device directory
+	 * @param[in]  *prefix Where the file lives
+	 * @param[out] *path   Where to put the name
+	 * @param[in]  size    The size of path
+	 *
+	 * @return             0 is success; -1 if the name does not fit
+	 */
+
+	size_t len = strlen(prefix), i;
+	size_t dirlen = strlen(dir);
+	
+	while(dirlen > 1 && dir[dirlen-1] == '/')
+		dirlen--;
+	if(len + dirlen + 1 > size)
+		return -1;
+	memcpy(path, prefix, len);
+	for(i = 0; i < dirlen; i++)
+		path[len++] = dir[i] == '/' ? '_' : dir[i];
+	path[len] = '\0';
+	return 0;
+}
+
+int
+DeviceAllowed(const char *dir, char *real)
+{
+	/**
+	 * Check that dir is a backlight the kernel registered, for when running
+	 * setuid root: it must resolve to a directory under /sys/devices, the
+	 * same place as the entry of that name under /sys/class/backlight. The
+	 * device has to be set up from real, as dir may be a link that can be
+	 * pointed elsewhere once checked.
+	 *
+	 * @param[in]  *dir  The device directory given
+	 * @param[out] *real Where dir resolves to, PATH_MAX long
+	 *
+	 * @return           1 if it may be used, 0 if not
+	 */
+
+	char entry[PATH_MAX], known[PATH_MAX];
+	if(!realpath(dir, real) || strncmp(real, "/sys/devices/", 13))
+		return 0;
+	const char *name = strrchr(real, '/');
+	snprintf(entry, sizeof(entry), "/sys/class/backlight%s", name);
+	return realpath(entry, known) && !strcmp(real, known);
+}
+
+int
+DeviceInit(Device *dev, const char *dir)
+{
+	/**
+	 * Fill in the paths of a backlight device from its directory
+	 *
+	 * @param[out] *dev A pointer to the device to fill in
+	 * @param[in]  *dir A zero terminated string containing the directory of
+	 *                  the device, with or without a trailing slash
+	 *
+	 * @return          0 is success; negative integer is failure
+	 */
+
+	size_t len = strlen(dir);
+	if(!len || len + sizeof("max_brightness") + 1 > sizeof(dev->dir))
+		return -1;
+	snprintf(dev->dir, sizeof(dev->dir), "%s%s", dir, dir[len-1] == '/' ? "" : "/");
+	snprintf(dev->brightness, PATH_MAX, "%sbrightness", dev->dir);
+	snprintf(dev->max_brightness, PATH_MAX, "%smax_brightness", dev->dir);
+	snprintf(dev->bl_power, PATH_MAX, "%sbl_power", dev->dir);
+	snprintf(dev->actual, PATH_MAX, "%sactual_brightness", dev->dir);
+	dev->observed = -1;
+	dev->yielded  = 0;
+	dev->cached   = -1;
+	dev->elided   = 0;
+	dev->lockfd   = -1;
+	
+	/* the same device reached through a link has to share the lock */
+	char real[PATH_MAX];
+	return DevicePath(realpath(dev->dir, real) ? real : dev->dir, LOCK_PREFIX,
+	                  dev->lock, sizeof(dev->lock));
+}
 
 int
 ReadSysFile(char *theFileName)
@@ -177,24 +826,20 @@ int
 CheckPerm(char *theFileName)
 {
 	/**
-	 * A function to check if this program can actually write to theFileName
+	 * A function to check if this program can actually write to theFileName.
+	 * Opening it for writing is enough to find out, writing the current
+	 * value back would only cost a sysfs write.
 	 *
 	 * @param[in] *theFileName A pointer to a zero terminated string
 	 *                         containing the name and path of the sys file
 	 * 
 	 * @return                 0 is success; negative integer is failure
 	*/
-	int current = ReadSysFile(theFileName);
-	
-	FILE *theFile = fopen(theFileName,"w");
-	if (!theFile)
+	int fd = open(theFileName, O_WRONLY|O_CLOEXEC);
+	if (fd == -1)
 		return -1;
-	int chars = fprintf(theFile,"%i\n",current);
-	int rval  = fclose(theFile);
-	//if all is good, return 0
-	return (rval < 0 && chars > -1 ? rval
-	                               : chars > 0 ? 0
-	                                           : chars);
+	close(fd);
+	return 0;
 }
 
 int
@@ -213,25 +858,101 @@ SetTo(char *theFileName, int target)
 	 *                         negative integer is failure
 	 */
 
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	FILE *theFile = fopen(theFileName,"w");
 	if (!theFile)
 		return -1;
 
 	int chars = fprintf(theFile,"%i\n",target);
 	int rval  = fclose(theFile);
+	HistogramObserve(&metrics->sysfs_write, ElapsedUs(&start));
 	
 	return (rval < 0 && chars > -1 ? rval : chars);
 }
 
+static int
+ElideWrite(Device *dev, int value)
+{
+	/* the device already holds value, count the write we did not make */
+	if(dev->cached != value)
+		return 0;
+	dev->elided++;
+	MetricAdd(&metrics->elided, 1);
+	return 1;
+}
+
+int
+SetBrightness(Device *dev, int target)
+{
+	/**
+	 * Write target to the brightness of dev, unless it already holds it
+	 *
+	 * @param[in,out] *dev   The device
+	 * @param[in]     target The value to be written
+	 *
+	 * @return               as SetTo
+	 */
+
+	char buf[16];
+	if(ElideWrite(dev, target))
+		return sprintf(buf, "%i\n", target);
+	int chars = SetTo(dev->brightness, target);
+	dev->cached = chars < 0 ? -1 : target;
+	return chars;
+}
+
+static int
+WriteStep(Device *dev, FILE *theFile, int value)
+{
+	char buf[16];
+	if(ElideWrite(dev, value))
+		return sprintf(buf, "%i\n", value);
+	
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* sysfs ignores the offset, a plain file standing in for it does not */
+	rewind(theFile);
+	int chars = fprintf(theFile, "%i\n", value);
+	HistogramObserve(&metrics->sysfs_write, ElapsedUs(&start));
+	dev->cached = chars < 0 ? -1 : value;
+	return chars;
+}
+
+static int
+ReadObserved(int fd)
+{
+	char buf[16];
+	ssize_t n = pread(fd, buf, sizeof(buf)-1, 0);
+	if(n < 1)
+		return -1;
+	buf[n] = '\0';
+	return atoi(buf);
+}
+
+static int
+WaitStep(int fd, const struct timespec *ts)
+{
+	/* sleep for a step, waking early if actual_brightness is notified */
+	struct pollfd pfd = { fd, POLLPRI, 0 };
+	int rval = ppoll(&pfd, 1, ts, NULL);
+	return (rval < 0 && errno != EINTR) ? -1 : 0;
+}
+
 int
-FadeTo(char *theFileName, int current, int change)
+FadeTo(Device *dev, int current, int change)
 {
 	/**
 	 * If fade_time and fade_step are in range, this function will transition
-	 * brightness from current to target
+	 * brightness from current to target.
+	 * 
+	 * Between steps it waits on actual_brightness, which the kernel notifies
+	 * when firmware or another writer changes the level. If the value read
+	 * back no longer matches what the last step left, the fade stops there
+	 * and leaves the new level alone, setting dev->yielded. dev->observed
+	 * holds the last value read back.
 	 *
-	 * @param[in] *theFileName A pointer to a zero terminated string
-	 *                         containing the name and path of the sys file
+	 * @param[in,out] *dev     The device to fade
 	 * 
 	 * @param[in] current      The value to be transitioned from
 	 * 
@@ -246,18 +967,20 @@ FadeTo(char *theFileName, int current, int change)
 
 	int target = current+change;
 
-	if(target < 1 || target > 852)
+	if(target < 1 || target > ReadSysFile(dev->max_brightness))
 		return 0;
 
 	if(fade_time < 1 || fade_time > 999
 	|| fade_step < 0 || fade_step > 0.5)
 	{
 		//no beautiful fading to be done :(
-		return SetTo(theFileName, target);
+		return SetBrightness(dev, target);
 	}
 	else
 	{
-		FILE *theFile = fopen(theFileName,"w");
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		FILE *theFile = fopen(dev->brightness,"w");
 		if (!theFile)
 			return -1;
 		/* return value and characters written */
@@ -266,9 +989,21 @@ FadeTo(char *theFileName, int current, int change)
 		/* so I don't have to call fflush() to write to disk */
 		rval = setvbuf(theFile, NULL, _IONBF, BUFSIZ);
 		if(rval)
+		{
+			fclose(theFile);
 			return -2;
+		}
+		
+		/* a plain file standing in for a device has no actual_brightness */
+		int watch = open(dev->actual, O_RDONLY|O_CLOEXEC);
+		if(watch == -1)
+			watch = open(dev->brightness, O_RDONLY|O_CLOEXEC);
+		dev->yielded = 0;
 		int step = (!fade_step ? (change < 0 ? -1 : 1)
 		                       : (int)round(change*fade_step));
+		/* small changes round to no step at all and would never arrive */
+		if(!step)
+			step = change < 0 ? -1 : 1;
 		
 		/* 
 		 * calculate time between iterations, proportional to 'change' + a bit
@@ -287,20 +1022,28 @@ FadeTo(char *theFileName, int current, int change)
 				current += step;
 				if(current >= target)
 				{
-					chars = fprintf(theFile, "%i\n", target);
+					chars = WriteStep(dev, theFile, target);
 					rval = chars < 0 ? -2 : 0;
+					dev->observed = ReadObserved(watch);
 					break;
 				}
-				if((chars = fprintf(theFile, "%i\n", current) < 0))
+				if((chars = WriteStep(dev, theFile, current)) < 0)
 				{
 					rval = -2;
 					break;
 				}
-				if((rval = nanosleep(&ts, NULL) && rval) && rval != EINTR)
+				dev->observed = ReadObserved(watch);
+				if(WaitStep(watch, &ts) < 0)
 				{
 					rval = -3;
 					break;
 				}
+				if(ReadObserved(watch) != dev->observed)
+				{
+					dev->yielded = 1;
+					rval = 0;
+					break;
+				}
 			}
 		}
 		else
@@ -310,30 +1053,79 @@ FadeTo(char *theFileName, int current, int change)
 				current += step;
 				if(current <= target)
 				{
-					chars = fprintf(theFile, "%i\n", target);
+					chars = WriteStep(dev, theFile, target);
 					rval = chars < 0 ? -2 : 0;
+					dev->observed = ReadObserved(watch);
 					break;
 				}
-				if((chars = fprintf(theFile, "%i\n", current) < 0))
+				if((chars = WriteStep(dev, theFile, current)) < 0)
 				{
 					rval = -2;
 					break;
 				}
-				if((rval = nanosleep(&ts, NULL) && rval) && rval != EINTR)
+				dev->observed = ReadObserved(watch);
+				if(WaitStep(watch, &ts) < 0)
 				{
 					rval = -3;
 					break;
 				}
+				if(ReadObserved(watch) != dev->observed)
+				{
+					dev->yielded = 1;
+					rval = 0;
+					break;
+				}
 			}
 		}
+		if(dev->yielded)
+		{
+			/* pick up the level the other writer left */
+			dev->observed = ReadObserved(watch);
+			dev->cached = ReadSysFile(dev->brightness);
+		}
+		if(watch != -1)
+			close(watch);
 		if(rval > -1)
 			rval = fclose(theFile);
 		else
 			fclose(theFile);
+		
+		unsigned long took = ElapsedUs(&start);
+		HistogramObserve(&metrics->fade_overrun,
+		                 took > fade_time*1000UL ? took - fade_time*1000UL
+		                                         : 0);
 		return (rval < 0 && chars > -1 ? rval : chars);
 	}
 }
 
+int
+SetPower(Device *dev, int on, int current)
+{
+	/**
+	 * Switch the panel on or off through bl_power. Switching off optionally
+	 * fades down first and then restores the brightness, so switching back
+	 * on is a single write.
+	 *
+	 * @param[in] *dev    The device to switch
+	 * @param[in] on      1 to switch on, 0 to switch off
+	 * @param[in] current The current brightness
+	 *
+	 * @return            0 or positive integer is success;
+	 *                    negative integer is failure
+	 */
+
+	if(on)
+		return SetTo(dev->bl_power, BL_POWER_ON);
+	
+	int faded = toggle_fade && current > 1;
+	if(faded && FadeTo(dev, current, 1 - current) < 0)
+		return -2;
+	int chars = SetTo(dev->bl_power, BL_POWER_OFF);
+	if(faded && SetBrightness(dev, current) < 0)
+		return -2;
+	return chars;
+}
+
 int
 parseIntArgument(char *arg)
 {
@@ -396,6 +1188,7 @@ parse_opt (int key, char *arg, struct argp_state *state)
 	 */
 	
 	ProgramArguments* argumentPtr = state->input;
+	char *endptr;
 	
 	switch (key)
 	{
@@ -409,6 +1202,29 @@ parse_opt (int key, char *arg, struct argp_state *state)
 		case 'i': arguments.inc=parseIntArgument(arg); break;
 		case 'd': arguments.dec=parseIntArgument(arg); break;
 		case 's': arguments.set=parseIntArgument(arg); break;
+		case 'm': argumentPtr->metrics  = arg; break;
+		case 'D':
+			if(argumentPtr->devices == MAX_DEVICES)
+				argp_error(state, "At most %i devices", MAX_DEVICES);
+			argumentPtr->device[argumentPtr->devices++] = arg;
+			break;
+		case OPT_RECORD: argumentPtr->record = arg; break;
+		case OPT_REPLAY: argumentPtr->replay = arg; break;
+		case OPT_PROFILE: argumentPtr->profile = 1; break;
+		case OPT_THERMAL: argumentPtr->thermal = 1; break;
+		case OPT_THERMAL_DIR: argumentPtr->thermaldir = arg; break;
+		case OPT_DAEMON: argumentPtr->daemon = 1; break;
+		case 'c': argumentPtr->client   = 1; break;
+		case OPT_IDLE: argumentPtr->idle = 1; break;
+		case OPT_BUS:  argumentPtr->bus  = arg; break;
+		case OPT_FOLLOW: argumentPtr->follow = 1; break;
+		case OPT_DITHER: argumentPtr->dither = 1; break;
+		case OPT_STRESS: argumentPtr->stress = parseIntArgument(arg); break;
+		case OPT_SPEED:
+			argumentPtr->speed = strtod(arg, &endptr);
+			if(*endptr || !(argumentPtr->speed > 0))
+				argp_error(state, "Invalid replay speed %s", arg);
+			break;
 		
 		case ARGP_KEY_NO_ARGS:
 			/* If there are no Arguments, that is good.	We don't want any */
@@ -439,34 +1255,2433 @@ GetContainingPath(char **path)
 	return sizeof(*path);
 }
 
-
 int
-SetLock(int l_type) /* F_WRLCK or F_UNLCK */
+StatePath(const Device *dev, char *path, size_t size)
 {
-	int fd;
-	struct flock fl;
-	fd = open("/tmp/brightLOCK", O_RDWR|O_CREAT);
-
-	if(fd == -1)
+	/*
+	 * the saved level of a device, one file each under STATE_DIR, named
+	 * like its lock after where the directory resolves to, so every way of
+	 * reaching a device shares it. restore.c must agree
+	 */
+	char real[PATH_MAX];
+	if(!realpath(dev->dir, real))
 		return -1;
-	
-	fl.l_type   = l_type;
+	return DevicePath(real, STATE_DIR, path, size);
+}
+
+int
+SaveState(const Device *dev, int level)
+{
+	/**
+	 * Save the level of a device so it can be restored later. The file is
+	 * written next to its final name, under a name of this process's own,
+	 * synced and renamed into place, and the directory synced, so a crash
+	 * or power loss leaves either the old level or the new one, and runs
+	 * saving at once do not mix their writes.
+	 *
+	 * @param[in] *dev  The device
+	 * @param[in] level The level to save
+	 *
+	 * @return          0 is success; negative integer is failure
+	 */
+
+	char path[PATH_MAX], tmpname[PATH_MAX + 16];
+	if(StatePath(dev, path, sizeof(path)))
+		return -1;
+	sprintf(tmpname, "%s.%i.tmp", path, (int)getpid());
+	mkdir(STATE_DIR, 0755);
+	
+	FILE *theFile = fopen(tmpname, "w");
+	if(!theFile)
+		return -1;
+	int chars = fprintf(theFile, "%i\n", level);
+	if(fflush(theFile) || fsync(fileno(theFile)))
+		chars = -1;
+	if(fclose(theFile) || chars < 0 || rename(tmpname, path))
+	{
+		unlink(tmpname);
+		return -2;
+	}
+	/* the rename itself only lasts once the directory is on disk */
+	int dir = open(STATE_DIR, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(dir != -1)
+	{
+		fsync(dir);
+		close(dir);
+	}
+	return 0;
+}
+
+static void
+SaveCurrent(Device *dev)
+{
+	/*
+	 * save the level the device holds, once its lock has been let go so
+	 * the syncs hold up no one waiting for it. Should a run have changed
+	 * it meanwhile, that level is saved, and the run saves it again after
+	 */
+	int level = ReadSysFile(dev->brightness);
+	if(level > 0)
+		SaveState(dev, level);
+}
+
+int
+LockFile(Device *dev, int l_type, int wait)
+{
+	/**
+	 * Take or release the lock of a device. Each device has its own lock
+	 * file, so work on one never waits for work on another. The locks are
+	 * open file description locks: they belong to the device's open lock
+	 * file rather than the process, so they also keep threads apart.
+	 * Nothing detects deadlocks between them, which is why several are only
+	 * ever taken through LockDevices.
+	 *
+	 * @param[in,out] *dev   The device
+	 * @param[in]     l_type F_WRLCK or F_UNLCK
+	 * @param[in]     wait   If set, wait for the lock instead of failing
+	 *
+	 * @return               0 is success; -1 is failure
+	 */
+
+	struct flock fl;
+	
+	/* kept open so long running modes can lock over and over */
+	if(dev->lockfd == -1)
+		dev->lockfd = open(dev->lock, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if(dev->lockfd == -1)
+		return -1;
+	
+	fl.l_type   = l_type;
 	fl.l_whence = SEEK_SET;
 	fl.l_start  = 0;
-	fl.l_len    = 0;
-	fl.l_pid    = getpid();
+	fl.l_len    = 1;  /* byte 1 is the daemon's, see DaemonLock */
+	fl.l_pid    = 0;
+	
+	/* try to create a file lock */
+	if(fcntl(dev->lockfd, (wait ? F_OFD_SETLKW : F_OFD_SETLK), &fl) == -1)
+		return -1;
+	return 0;
+}
+
+int
+SetLock(Device *dev, int l_type) /* F_WRLCK or F_UNLCK */
+{
+	return LockFile(dev, l_type, l_type == F_WRLCK);
+}
+
+static int
+DaemonLock(Device *dev)
+{
+	/**
+	 * Claim a device for a daemon, held until it exits: byte 1 of the
+	 * device's lock file, apart from the byte fades lock
+	 *
+	 * @param[in,out] *dev The device
+	 *
+	 * @return             0 is success; -1 if another daemon drives it
+	 */
+
+	struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET,
+	                    .l_start = 1, .l_len = 1 };
+	
+	if(dev->lockfd == -1)
+		dev->lockfd = open(dev->lock, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if(dev->lockfd == -1)
+		return -1;
+	return fcntl(dev->lockfd, F_OFD_SETLK, &fl) == -1 ? -1 : 0;
+}
+
+static int
+CompareDevices(const void *a, const void *b)
+{
+	return strcmp((*(Device * const *)a)->lock, (*(Device * const *)b)->lock);
+}
+
+int
+LockDevices(Device **devs, int n, int l_type)
+{
+	/**
+	 * Take or release the locks of several devices. They are taken in
+	 * order of lock file name, whoever asks, so two runs wanting some of the
+	 * same devices cannot each hold a lock the other waits for.
+	 *
+	 * @param[in,out] **devs The devices, sorted into that order
+	 * @param[in]     n      The number of devices
+	 * @param[in]     l_type F_WRLCK or F_UNLCK
+	 *
+	 * @return               0 is success; -1 if a lock could not be taken,
+	 *                       in which case none are held
+	 */
+
+	int i;
+	qsort(devs, n, sizeof(*devs), CompareDevices);
+	for(i = 0; i < n; i++)
+	{
+		/* a second lock on the same file would wait for the first */
+		if(i && !strcmp(devs[i]->lock, devs[i-1]->lock))
+			continue;
+		if(SetLock(devs[i], l_type) == -1 && l_type == F_WRLCK)
+		{
+			while(i--)
+				SetLock(devs[i], F_UNLCK);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+ReadHottest(const char *dir)
+{
+	/**
+	 * Find the highest temperature of the thermal zones under dir
+	 *
+	 * @param[in] *dir A zero terminated string containing the directory
+	 *                 holding the thermal_zone* directories
+	 *
+	 * @return         the temperature in millidegrees C.
+	 *                 -1 if no zone could be read
+	 */
+
+	char pattern[PATH_MAX];
+	glob_t zones;
+	int hottest = -1, temp;
+	size_t i;
+	
+	snprintf(pattern, sizeof(pattern), "%s/thermal_zone*/temp", dir);
+	if(glob(pattern, 0, NULL, &zones))
+		return -1;
+	for(i = 0; i < zones.gl_pathc; i++)
+	{
+		/* zones that cannot report right now fail the read, skip them */
+		FILE *theFile = fopen(zones.gl_pathv[i], "r");
+		if(!theFile)
+			continue;
+		if(fscanf(theFile, "%i", &temp) == 1 && temp > hottest)
+			hottest = temp;
+		fclose(theFile);
+	}
+	globfree(&zones);
+	return hottest;
+}
+
+int
+ThermalOpen(void)
+{
+	/**
+	 * Open a socket receiving kernel uevents, which thermal zones send when
+	 * they cross a trip point
+	 *
+	 * @return the socket, -1 if uevents are not available
+	 */
+
+	struct sockaddr_nl addr = { AF_NETLINK, 0, 0, 1 };
+	int fd = socket(AF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC,
+	                NETLINK_KOBJECT_UEVENT);
+	if(fd != -1 && bind(fd, (struct sockaddr*)&addr, sizeof(addr)))
+	{
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+void
+ThermalWait(int fd)
+{
+	/**
+	 * Wait for a thermal uevent or thermal_poll_ms, whichever comes first.
+	 * Uevents from other subsystems are read and ignored.
+	 *
+	 * @param[in] fd The socket from ThermalOpen, may be -1
+	 */
+
+	/* the payload is NUL separated KEY=value strings after the summary */
+	static const char thermal[] = "\0SUBSYSTEM=thermal";
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	struct timespec start;
+	int timeout = thermal_poll_ms;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	while(timeout > 0 && poll(&pfd, 1, timeout) > 0)
+	{
+		/* one check covers however many uevents came in */
+		char buf[4096];
+		ssize_t n;
+		int seen = 0;
+		while((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+			seen |= memmem(buf, n, thermal, sizeof(thermal)) != NULL;
+		if(seen)
+			return;
+		timeout = thermal_poll_ms - (int)(ElapsedUs(&start)/1000);
+	}
+}
+
+int
+ThermalHot(const char *dir, int capped, int *temp)
+{
+	/**
+	 * Decide whether the cap should be on, with hysteresis
+	 *
+	 * @param[in]  *dir   The directory holding the thermal_zone* directories
+	 * @param[in]  capped Whether the cap is on now
+	 * @param[out] *temp  The hottest temperature found
+	 *
+	 * @return            1 if the cap should be on, 0 if not
+	 */
+
+	*temp = ReadHottest(dir);
+	return capped ? *temp > thermal_release_temp
+	              : *temp >= thermal_cap_temp;
+}
+
+int
+ThermalWatch(Device *dev, const char *dir)
+{
+	/**
+	 * Watch the thermal zones and cap the brightness while they are hot.
+	 * When the cap comes on the brightness fades down to it, remembering
+	 * where it was, and if anyone raises it past the cap it is faded back
+	 * down. Once cooled to thermal_release_temp it fades back to where it
+	 * was, unless it was changed in the meantime. Never returns unless the
+	 * device cannot be read.
+	 *
+	 * Thermal zones send a uevent when they cross a trip point, so the
+	 * zones are checked as soon as one arrives, and every thermal_poll_ms
+	 * for zones without trip points or a fake tree.
+	 *
+	 * @param[in] *dev The device to cap
+	 * @param[in] *dir A zero terminated string containing the directory
+	 *                 holding the thermal_zone* directories
+	 *
+	 * @return         EXIT_FAILURE
+	 */
+
+	int max_brightness = ReadSysFile(dev->max_brightness);
+	if(max_brightness < 0)
+		return EXIT_FAILURE;
+	int cap = thermal_cap*max_brightness/100;
+	int capped = 0, saved = -1, temp;
+	int uevents = ThermalOpen();
+	
+	for(;;)
+	{
+		int hot = ThermalHot(dir, capped, &temp);
+		
+		if(hot || capped)
+		{
+			if(SetLock(dev, F_WRLCK) == -1)
+				return EXIT_FAILURE;
+			int brightness = ReadSysFile(dev->brightness);
+			if(brightness < 0)
+				return EXIT_FAILURE;
+			
+			if(hot && brightness > cap)
+			{
+				/* a rise past the cap while capped is the new level to return to */
+				saved = brightness;
+				if(!arguments.quiet)
+					printf("%.1f C: capping brightness %i to %i\n",
+					       temp/1000.0, brightness, cap);
+				FadeTo(dev, brightness, cap - brightness);
+			}
+			else if(!hot && saved > 0 && brightness == cap)
+			{
+				if(!arguments.quiet)
+					printf("%.1f C: restoring brightness %i\n",
+					       temp/1000.0, saved);
+				FadeTo(dev, brightness, saved - brightness);
+			}
+			SetLock(dev, F_UNLCK);
+			fflush(stdout);
+			
+			if(!hot)
+				saved = -1;
+			capped = hot;
+		}
+		ThermalWait(uevents);
+	}
+}
+
+/*
+ * --daemon splits the work between threads. The main thread serves clients
+ * on SOCKET_FILE, --thermal adds a thread watching the thermal zones, and a
+ * single fade thread owns the device. They hand requests to the fade thread
+ * through bounded lock-free queues and wake it with an eventfd, so the fade
+ * thread only ever waits on its step timer and its own device writes.
+ *
+ * manual requests, waking up and resuming go through their own queue, which
+ * the fade thread empties first, so background sources flooding theirs can
+ * neither delay nor crowd out a key press
+ */
+
+#define QUEUE_SIZE 64 /* must be a power of two */
+
+enum { CMD_SET, CMD_INC, CMD_DEC, CMD_CLEAR, CMD_CAP, CMD_SLEEP, CMD_RESUME };
+
+/*
+ * where a request came from. the sources up to SRC_IDLE ask for a level and
+ * the first one asking wins; the rest only cap it
+ */
+enum { SRC_MANUAL, SRC_SCHEDULE, SRC_AMBIENT, SRC_IDLE, SRC_THERMAL,
+       SOURCES };
+#define TARGET_SOURCES SRC_IDLE
+static const char *source_names[SOURCES] =
+	{"manual", "schedule", "ambient", "idle", "thermal"};
+
+enum { QOS_INTERACTIVE, QOS_BACKGROUND, QOS_LEVELS };
+
+/**
+ * A request for the fade thread
+ */
+typedef struct {
+	int type;    /**< one of CMD_* */
+	int source;  /**< one of SRC_* */
+	int value;   /**< new level, change or cap; a cap of -1 lifts it */
+	int percent; /**< If set, value is a percentage */
+	struct timespec sent; /**< when a resume was signalled */
+} Command;
+
+/**
+ * A slot of the queue. seq tells producers and the consumer whose turn it
+ * is to use the slot.
+ */
+typedef struct {
+	unsigned long seq;
+	Command       cmd;
+} QueueCell;
+
+/**
+ * A bounded multi-producer single-consumer queue of commands
+ */
+typedef struct {
+	QueueCell     cell[QUEUE_SIZE];
+	unsigned long head;  /**< next slot to claim, shared by producers */
+	unsigned long tail;  /**< next slot to read, owned by the consumer */
+	int           wake;  /**< eventfd written after each push */
+} CommandQueue;
+
+void
+QueueInit(CommandQueue *q, int wake)
+{
+	unsigned long i;
+	for(i = 0; i < QUEUE_SIZE; i++)
+		q->cell[i].seq = i;
+	q->head = q->tail = 0;
+	q->wake = wake;
+}
+
+int
+QueuePush(CommandQueue *q, const Command *cmd)
+{
+	/**
+	 * Add a command to the queue and wake the consumer. Safe to call from
+	 * any number of threads at once.
+	 *
+	 * @param[in,out] *q   The queue
+	 * @param[in]     *cmd The command to add
+	 *
+	 * @return             0 is success; -1 if the queue is full
+	 */
+
+	unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	QueueCell *cell;
+	
+	for(;;)
+	{
+		cell = &q->cell[pos & (QUEUE_SIZE-1)];
+		long dif = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE)
+		         - (long)pos;
+		if(dif == 0)
+		{
+			if(__atomic_compare_exchange_n(&q->head, &pos, pos+1, 1,
+			                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(dif < 0)
+			return -1;
+		else
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
+	cell->cmd = *cmd;
+	__atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+	
+	uint64_t one = 1;
+	write(q->wake, &one, sizeof(one));
+	return 0;
+}
+
+int
+QueuePop(CommandQueue *q, Command *cmd)
+{
+	/**
+	 * Take the oldest command off the queue. Only the consumer may call this.
+	 *
+	 * @param[in,out] *q   The queue
+	 * @param[out]    *cmd Where to put the command
+	 *
+	 * @return             1 if a command was taken, 0 if the queue is empty
+	 */
+
+	QueueCell *cell = &q->cell[q->tail & (QUEUE_SIZE-1)];
+	if(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != q->tail+1)
+		return 0;
+	*cmd = cell->cmd;
+	__atomic_store_n(&cell->seq, q->tail + QUEUE_SIZE, __ATOMIC_RELEASE);
+	q->tail++;
+	return 1;
+}
+
+/**
+ * The levels asked for by each source, resolved into the one to fade to
+ */
+typedef struct {
+	int level[SOURCES];     /**< target or cap of each source, -1 if none */
+	struct timespec expiry; /**< when the manual override lapses */
+	int source;             /**< source that decided the last level */
+	int base;               /**< level when no source asks for one */
+	int min;                /**< lowest level a target may have */
+	int max;                /**< max_brightness */
+} Arbiter;
+
+/**
+ * A token bucket
+ */
+typedef struct {
+	double          tokens;
+	struct timespec last;   /**< when tokens was brought up to date */
+} Bucket;
+
+/*
+ * The daemon publishes every level it writes into a ring mapped from
+ * RING_FILE, which any number of local readers can follow without the
+ * daemon doing anything per reader. Each slot is a seqlock: its seq is the
+ * number of the event it holds, zeroed while being rewritten, so a reader
+ * that finds another number there knows it has been lapped. The ring's seq
+ * is the number of the last event and doubles as the futex readers sleep
+ * on. Readers only ever map it read-only.
+ */
+
+/**
+ * One change, as published in the ring
+ */
+typedef struct {
+	unsigned int    seq;    /**< event number, 0 while being written */
+	int             value;  /**< level written */
+	int             source; /**< one of SRC_* */
+	struct timespec when;   /**< monotonic time of the write */
+} RingSlot;
+
+/**
+ * Layout of RING_FILE
+ */
+typedef struct {
+	unsigned int magic;          /**< RING_MAGIC once set up */
+	unsigned int seq;            /**< last event published, the futex word */
+	int          max_brightness;
+	RingSlot     slot[RING_SIZE];
+} Ring;
+
+/**
+ * State shared between the daemon threads
+ */
+typedef struct {
+	Device       *dev;
+	CommandQueue  queue[QOS_LEVELS];
+	char         *thermaldir;     /**< NULL unless --thermal */
+	char         *bus;            /**< D-Bus address, NULL for system bus */
+	int           max_brightness;
+	int           current;        /**< level last written, read atomically */
+	int           wanted;         /**< level being faded to, read atomically */
+	Bucket        limit[TARGET_SOURCES]; /**< per source, main thread only */
+	Command       held[TARGET_SOURCES];  /**< requests held back by Admit,
+	                                          main thread only */
+	unsigned int  holding;        /**< bit set for each source held */
+	Ring         *ring;           /**< NULL if RING_FILE could not be mapped */
+	int           onbattery;      /**< set by the main thread with --dither,
+	                                   read atomically */
+	int           save;           /**< level for the main thread to save,
+	                                   0 if none, swapped atomically */
+	int           saver;          /**< eventfd waking it to save */
+	int           release;        /**< set with a save that lets a suspend
+	                                   go ahead once done, swapped atomically */
+	int           inhibitor;      /**< pipe keeping the sleep delay lock
+	                                   held, -1 if none, swapped atomically */
+} Daemon;
+
+static int
+Clamp(int value, int low, int high)
+{
+	return value < low ? low : value > high ? high : value;
+}
+
+static void
+SaveLater(Daemon *d, int level, int release)
+{
+	/*
+	 * have the main thread save the level, the newest one asked wins. With
+	 * release it then lets go of the sleep delay lock
+	 */
+	uint64_t one = 1;
+	__atomic_store_n(&d->save, level, __ATOMIC_RELEASE);
+	if(release)
+		__atomic_store_n(&d->release, 1, __ATOMIC_RELEASE);
+	write(d->saver, &one, sizeof(one));
+}
+
+static void
+ArmTimer(int timer, const struct timespec *when)
+{
+	struct itimerspec its = { {0, 0}, *when };
+	timerfd_settime(timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void
+AddNs(struct timespec *ts, long ns)
+{
+	ts->tv_nsec += ns;
+	ts->tv_sec  += ts->tv_nsec / 1000000000L;
+	ts->tv_nsec %= 1000000000L;
+}
+
+static int
+Before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec
+	   || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+void
+ArbiterInit(Arbiter *a, int level, int min, int max)
+{
+	int i;
+	for(i = 0; i < SOURCES; i++)
+		a->level[i] = -1;
+	a->base = level;
+	a->min  = min;
+	a->max  = max;
+}
+
+void
+ArbiterManual(Arbiter *a, int level, const struct timespec *now)
+{
+	/**
+	 * Record a manual change. It overrides the other targets for
+	 * manual_override seconds, and being a sign of life ends idle dimming.
+	 *
+	 * @param[in,out] *a     The arbiter
+	 * @param[in]     level  The level asked for
+	 * @param[in]     *now   The monotonic time
+	 */
+
+	a->level[SRC_MANUAL] = Clamp(level, a->min, a->max);
+	a->level[SRC_IDLE]   = -1;
+	a->expiry = *now;
+	a->expiry.tv_sec += manual_override;
+}
+
+int
+ArbiterTarget(Arbiter *a, const struct timespec *now)
+{
+	/**
+	 * Find the level asked for by the highest priority source, before caps.
+	 * A manual override that has lapsed becomes the level to go back to
+	 * when no source asks for anything.
+	 *
+	 * @param[in,out] *a   The arbiter
+	 * @param[in]     *now The monotonic time
+	 *
+	 * @return             the level
+	 */
+
+	int i;
+	if(a->level[SRC_MANUAL] >= 0 && !Before(now, &a->expiry))
+	{
+		a->base = a->level[SRC_MANUAL];
+		a->level[SRC_MANUAL] = -1;
+	}
+	for(i = 0; i < TARGET_SOURCES; i++)
+		if(a->level[i] >= 0)
+			return a->level[a->source = i];
+	a->source = SRC_MANUAL;
+	return a->base;
+}
+
+int
+ArbiterResolve(Arbiter *a, const struct timespec *now)
+{
+	/**
+	 * Find the level to fade to: the highest priority target under the
+	 * lowest cap. Takes a fixed number of steps whatever the sources ask.
+	 *
+	 * @param[in,out] *a   The arbiter
+	 * @param[in]     *now The monotonic time
+	 *
+	 * @return             the level
+	 */
+
+	int i, level = ArbiterTarget(a, now);
+	for(i = TARGET_SOURCES; i < SOURCES; i++)
+		if(a->level[i] >= 0 && a->level[i] < level)
+			level = a->level[a->source = i];
+	return Clamp(level, a->min, a->max);
+}
+
+static char *
+RingFile(void)
+{
+	char *name = elevated ? NULL : getenv("BACKLIGHT_RING");
+	return name ? name : RING_FILE;
+}
+
+Ring *
+RingOpen(int max)
+{
+	/**
+	 * Map the ring for publishing, creating it if needed. Numbering carries
+	 * on from a previous run so readers that outlive it are not confused.
+	 *
+	 * @param[in] max The max_brightness of the device
+	 *
+	 * @return        the ring, NULL if it cannot be mapped
+	 */
+
+	int fd = open(RingFile(), O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0644);
+	if(fd == -1 || ftruncate(fd, sizeof(Ring)) == -1)
+	{
+		if(fd != -1)
+			close(fd);
+		return NULL;
+	}
+	Ring *r = mmap(NULL, sizeof(Ring), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(r == MAP_FAILED)
+		return NULL;
+	if(r->magic != RING_MAGIC)
+	{
+		memset(r, 0, sizeof(Ring));
+		r->magic = RING_MAGIC;
+	}
+	r->max_brightness = max;
+	return r;
+}
+
+void
+Publish(Ring *r, int value, int source)
+{
+	/**
+	 * Publish a change in the ring and wake its readers. Costs the same
+	 * single futex call however many readers there are.
+	 *
+	 * @param[in,out] *r      The ring, NULL to do nothing
+	 * @param[in]     value   The level written
+	 * @param[in]     source  The source it was written for
+	 */
+
+	if(!r)
+		return;
+	unsigned int seq = r->seq + 1 ? r->seq + 1 : 1;
+	RingSlot *slot = &r->slot[seq & (RING_SIZE-1)];
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->value, value, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->source, source, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->when.tv_sec, now.tv_sec, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->when.tv_nsec, now.tv_nsec, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->seq, seq, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &r->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+int
+RingRead(const Ring *r, unsigned int *next, RingSlot *event)
+{
+	/**
+	 * Take the next event from the ring, waiting for one if need be
+	 *
+	 * @param[in]     *r     The ring
+	 * @param[in,out] *next  The number of the event wanted, moved past the
+	 *                       one returned
+	 * @param[out]    *event The event
+	 *
+	 * @return               the number of events lost to overruns before
+	 *                       this one
+	 */
+
+	unsigned int head, lost = 0;
+	for(;;)
+	{
+		while((head = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE)) == *next - 1)
+			syscall(SYS_futex, &r->seq, FUTEX_WAIT, head, NULL, NULL, 0);
+		
+		/* lapped, or the daemon started afresh: skip to the oldest kept */
+		if(head - *next >= RING_SIZE)
+		{
+			unsigned int oldest = head >= RING_SIZE ? head - RING_SIZE + 1 : 1;
+			lost += head - *next < UINT_MAX/2 ? oldest - *next : 0;
+			*next = oldest ? oldest : 1;
+		}
+		
+		const RingSlot *slot = &r->slot[*next & (RING_SIZE-1)];
+		unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		event->value  = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+		event->source = __atomic_load_n(&slot->source, __ATOMIC_RELAXED);
+		event->when.tv_sec  = __atomic_load_n(&slot->when.tv_sec,
+		                                      __ATOMIC_RELAXED);
+		event->when.tv_nsec = __atomic_load_n(&slot->when.tv_nsec,
+		                                      __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(seq == *next && __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+		{
+			event->seq = seq;
+			*next = seq + 1 ? seq + 1 : 1;
+			return lost;
+		}
+		/* overwritten while we looked, the producer is a lap ahead */
+		lost++;
+		*next = *next + 1 ? *next + 1 : 1;
+	}
+}
+
+int
+Follow(void)
+{
+	/**
+	 * Print each level the daemon writes, with the source it was written
+	 * for and how long after the write it was seen, from the ring
+	 *
+	 * @return EXIT_FAILURE if the ring cannot be mapped
+	 */
+
+	int fd = open(RingFile(), O_RDONLY|O_CLOEXEC);
+	const Ring *r = fd == -1 ? MAP_FAILED
+	              : mmap(NULL, sizeof(Ring), PROT_READ, MAP_SHARED, fd, 0);
+	if(fd != -1)
+		close(fd);
+	if(r == MAP_FAILED || r->magic != RING_MAGIC)
+	{
+		printf("Couldn't map %s, is the daemon running?\n", RingFile());
+		return EXIT_FAILURE;
+	}
+	
+	/* start with the last change, if there was one */
+	unsigned int next = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+	RingSlot event;
+	if(!next)
+		next = 1;
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	
+	for(;;)
+	{
+		int lost = RingRead(r, &next, &event);
+		if(lost && !arguments.quiet)
+			printf("Missed %i changes\n", lost);
+		if(arguments.quiet)
+			continue;
+		if(arguments.verbose)
+			printf("%u: %i/%i (%s) seen after %lu us\n", event.seq,
+			       event.value, r->max_brightness,
+			       source_names[Clamp(event.source, 0, SOURCES-1)],
+			       ElapsedUs(&event.when));
+		else
+			printf("%i\n", arguments.percent
+			       ? (int)round(event.value*100.0/r->max_brightness)
+			       : event.value);
+	}
+}
+
+int
+Submit(Daemon *d, const Command *cmd)
+{
+	/**
+	 * Queue a command for the fade thread, on the interactive queue if it
+	 * is manual, lifts idle dimming or concerns suspend
+	 *
+	 * @param[in,out] *d   The daemon
+	 * @param[in]     *cmd The command
+	 *
+	 * @return             0 is success; -1 if the queue is full
+	 */
+
+	int interactive = cmd->source == SRC_MANUAL
+	               || cmd->type == CMD_SLEEP || cmd->type == CMD_RESUME
+	               || (cmd->source == SRC_IDLE && cmd->value < 0);
+	return QueuePush(&d->queue[interactive ? QOS_INTERACTIVE
+	                                       : QOS_BACKGROUND], cmd);
+}
+
+int
+OnBattery(void)
+{
+	/**
+	 * Find out whether the machine runs on battery: it has a mains supply
+	 * and none of them is online
+	 *
+	 * @return 1 if on battery, 0 if not or if there is no telling
+	 */
+
+	char path[PATH_MAX], type[16];
+	glob_t supplies;
+	int mains = 0, online = 0;
+	size_t i;
+	
+	if(glob(POWER_DIR "/*/type", 0, NULL, &supplies))
+		return 0;
+	for(i = 0; i < supplies.gl_pathc; i++)
+	{
+		FILE *theFile = fopen(supplies.gl_pathv[i], "r");
+		if(!theFile)
+			continue;
+		if(fscanf(theFile, "%15s", type) == 1 && !strcmp(type, "Mains"))
+		{
+			mains = 1;
+			snprintf(path, sizeof(path), "%.*sonline",
+			         (int)(strlen(supplies.gl_pathv[i]) - strlen("type")),
+			         supplies.gl_pathv[i]);
+			online |= ReadSysFile(path) == 1;
+		}
+		fclose(theFile);
+	}
+	globfree(&supplies);
+	return mains && !online;
+}
+
+static int
+Dither(int *sigma, int level, int scale)
+{
+	/**
+	 * Pick the raw level to write next for a level in 1/scale steps. A
+	 * first order sigma-delta: the error of each choice is carried into
+	 * the next, so on average the raw level written matches exactly.
+	 *
+	 * @param[in,out] *sigma The carried error, 0 to start
+	 * @param[in]     level  The level wanted, in 1/scale steps
+	 * @param[in]     scale  Steps to a raw level
+	 *
+	 * @return               the raw level
+	 */
+
+	*sigma += level % scale;
+	if(*sigma < scale)
+		return level/scale;
+	*sigma -= scale;
+	return level/scale + 1;
+}
+
+void *
+FadeThread(void *arg)
+{
+	/**
+	 * Apply queued commands to the device. Commands update what each
+	 * source asks for, and the Arbiter turns that into one level that is
+	 * faded towards one step per timer tick. A command arriving mid fade
+	 * retargets the running fade rather than starting another, so bursts of
+	 * requests coalesce into one fade. A manual command also restarts the
+	 * step timer so its first step is taken at once. Each step is written
+	 * with a single pwrite and its lateness is recorded as step jitter.
+	 * Changes made by others are adopted as manual ones, as in FadeTo.
+	 * Every level written or adopted is published in the ring, and the one
+	 * each fade ends at is saved for backlight-restore.
+	 *
+	 * With --dither levels are kept in 1/dither_scale steps of a raw level.
+	 * While one falls between two raw levels the timer keeps ticking at the
+	 * dither rate, each tick writing whichever of them Dither picks. The
+	 * thread's own CPU time is checked every second against
+	 * dither_cpu_limit. On battery, as the main thread finds out, or when
+	 * over budget even at dither_min_hz, the nearest raw level is written
+	 * instead.
+	 *
+	 * Lifting the idle cap jumps straight back with a single write that
+	 * cuts any fade in progress short.
+	 *
+	 * Before suspend any fade is stopped, and commands arriving until the
+	 * resume only update what the sources ask for. On resume the level the
+	 * device came back at is ignored and the wanted level is written
+	 * straight away, with any fade planned afresh from the monotonic
+	 * clock. The time from the resume signal to that write is recorded.
+	 *
+	 * @param[in,out] *arg The Daemon
+	 *
+	 * @return             never returns
+	 */
+
+	Daemon *d = arg;
+	int scale = arguments.dither ? dither_scale : 1;
+	int max = d->max_brightness*scale;
+	int current = d->current*scale, wanted = current;
+	int goal = current, step = 0, moving = 0, locked = 0;
+	int prompt = 0, urgent = 0, resuming = 0, sleeping = 0, level, raw;
+	int sigma = 0, dithering = 0, calm = 0;
+	int ditherable = scale > 1 && !__atomic_load_n(&d->onbattery,
+	                                                __ATOMIC_RELAXED);
+	long interval = 0, period = 1000000000L/dither_hz;
+	struct timespec deadline, now, window, cpu, used;
+	struct timespec resumed = { 0, 0 }, disarm = { 0, 0 };
+	Arbiter arbiter;
+	Command cmd;
+	
+	ArbiterInit(&arbiter, current, lower_limit*scale, max);
+	clock_gettime(CLOCK_MONOTONIC, &window);
+	deadline = window;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	int out = open(d->dev->brightness, O_WRONLY|O_CLOEXEC);
+	int watch = open(d->dev->actual, O_RDONLY|O_CLOEXEC);
+	if(watch == -1)
+		watch = open(d->dev->brightness, O_RDONLY|O_CLOEXEC);
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+	int observed = ReadObserved(watch);
+	
+	struct pollfd pfd[3] = {
+		{ d->queue[0].wake, POLLIN, 0 },
+		{ timer, POLLIN, 0 },
+		{ watch, POLLPRI, 0 }
+	};
+	
+	for(;;)
+	{
+		/* wake up in time to let a manual override lapse */
+		int timeout = -1;
+		if(arbiter.level[SRC_MANUAL] >= 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout = Before(&now, &arbiter.expiry)
+			        ? (arbiter.expiry.tv_sec - now.tv_sec)*1000
+			        + (arbiter.expiry.tv_nsec - now.tv_nsec)/1000000 + 1
+			        : 0;
+		}
+		poll(pfd, 3, timeout);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		
+		uint64_t count;
+		read(pfd[0].fd, &count, sizeof(count));
+		int qos = QOS_INTERACTIVE;
+		while(qos < QOS_LEVELS)
+		{
+			if(!QueuePop(&d->queue[qos], &cmd))
+			{
+				qos++;
+				continue;
+			}
+			level = cmd.percent ? (int)round(cmd.value*max/100.0)
+			                    : cmd.value*scale;
+			switch(cmd.type)
+			{
+				case CMD_SET:
+					if(cmd.source == SRC_MANUAL)
+						ArbiterManual(&arbiter, level, &now);
+					else
+						arbiter.level[cmd.source] = Clamp(level, 0, max);
+					break;
+				/* relative to where we are heading, so key repeat adds up */
+				case CMD_INC:
+				case CMD_DEC:
+					ArbiterManual(&arbiter, ArbiterTarget(&arbiter, &now)
+					              + (cmd.type == CMD_INC ? level : -level),
+					              &now);
+					break;
+				case CMD_CLEAR:
+					arbiter.level[cmd.source] = -1;
+					break;
+				case CMD_CAP:
+					urgent |= cmd.source == SRC_IDLE && cmd.value < 0
+					       && arbiter.level[SRC_IDLE] >= 0;
+					arbiter.level[cmd.source] = cmd.value < 0 ? -1 : level;
+					break;
+				case CMD_SLEEP:
+				case CMD_RESUME:
+					ArmTimer(timer, &disarm);
+					if(locked)
+						LockFile(d->dev, F_UNLCK, 0);
+					moving = locked = dithering = 0;
+					/* nothing is planned until the resume */
+					sleeping = cmd.type == CMD_SLEEP;
+					/* checkpoint, then the suspend may go ahead */
+					if(sleeping)
+					{
+						SaveLater(d, (ArbiterResolve(&arbiter, &now) + scale/2)
+						             /scale, 1);
+						break;
+					}
+					/* whatever the firmware left is not a change to adopt */
+					d->dev->cached = -1;
+					if((observed = ReadObserved(watch)) >= 0)
+						current = observed*scale;
+					__atomic_store_n(&d->current, current/scale,
+					                 __ATOMIC_RELAXED);
+					resumed = cmd.sent;
+					resuming = urgent = 1;
+					break;
+			}
+			prompt |= cmd.source == SRC_MANUAL;
+		}
+		
+		/* someone else moved the level, go along with it */
+		int seen = sleeping ? -1 : ReadObserved(watch);
+		if(seen >= 0 && seen != observed)
+		{
+			observed = seen;
+			current = goal = seen*scale;
+			ArbiterManual(&arbiter, current, &now);
+			d->dev->cached = -1;
+			__atomic_store_n(&d->current, seen, __ATOMIC_RELAXED);
+			Publish(d->ring, seen, SRC_MANUAL);
+			if(moving)
+			{
+				moving = locked = 0;
+				LockFile(d->dev, F_UNLCK, 0);
+			}
+			/* a tick left armed would keep poll returning at once */
+			dithering = 0;
+			ArmTimer(timer, &disarm);
+		}
+		
+		wanted = ArbiterResolve(&arbiter, &now);
+		__atomic_store_n(&d->wanted, (wanted + scale/2)/scale,
+		                 __ATOMIC_RELAXED);
+		if(!sleeping && wanted != current
+		&& (!moving || wanted != goal || prompt || urgent))
+		{
+			goal = wanted;
+			int change = goal - current;
+			if(urgent || fade_time < 1 || fade_time > 999
+			|| fade_step <= 0 || fade_step > 0.5)
+				step = change;
+			else
+				step = (int)round(change*fade_step);
+			if(!step)
+				step = change < 0 ? -1 : 1;
+			interval = fade_time*1000000L/((double)change/step);
+			if(!moving || prompt || urgent)
+			{
+				deadline = now;
+				ArmTimer(timer, &deadline);
+				moving = 1;
+			}
+		}
+		/* asked for the level a fade is passing through, stop it there */
+		else if(!sleeping && moving && wanted == current)
+		{
+			goal = current;
+			moving = locked = 0;
+			LockFile(d->dev, F_UNLCK, 0);
+			if(!(dithering = current % scale))
+				ArmTimer(timer, &disarm);
+			if(current >= scale)
+				SaveLater(d, (current + scale/2)/scale, 0);
+		}
+		prompt = urgent = 0;
+		if(resuming && !moving)
+		{
+			/* came back at the right level, nothing to write */
+			HistogramObserve(&metrics->resume_restore, ElapsedUs(&resumed));
+			resuming = 0;
+		}
+		
+		if((!moving && !dithering)
+		|| read(timer, &count, sizeof(count)) != sizeof(count))
+			continue;
+		
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		HistogramObserve(&metrics->step_jitter,
+		                 (now.tv_sec - deadline.tv_sec)*1000000UL
+		               + (now.tv_nsec - deadline.tv_nsec)/1000);
+		
+		/*
+		 * stay out of the way of a command line run already fading. Dither
+		 * ticks go unlocked, a run starting meanwhile is adopted as above
+		 */
+		if(moving && !locked && !(locked = !LockFile(d->dev, F_WRLCK, 0)))
+		{
+			AddNs(&deadline, 10000000L);
+			ArmTimer(timer, &deadline);
+			continue;
+		}
+		
+		if(moving)
+		{
+			current += step;
+			if((step > 0 && current > goal) || (step < 0 && current < goal))
+				current = goal;
+		}
+		raw = ditherable ? Dither(&sigma, current, scale)
+		                 : (current + scale/2)/scale;
+		
+		if(!ElideWrite(d->dev, raw))
+		{
+			char buf[16];
+			int len = sprintf(buf, "%i\n", raw);
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if(pwrite(out, buf, len, 0) != len)
+			{
+				MetricAdd(&metrics->errors[ERR_WRITE], 1);
+				d->dev->cached = -1;
+			}
+			else
+				d->dev->cached = raw;
+			HistogramObserve(&metrics->sysfs_write, ElapsedUs(&start));
+			observed = ReadObserved(watch);
+		}
+		__atomic_store_n(&d->current, (current + scale/2)/scale,
+		                 __ATOMIC_RELAXED);
+		if(moving)
+			Publish(d->ring, raw, arbiter.source);
+		if(resuming)
+		{
+			HistogramObserve(&metrics->resume_restore, ElapsedUs(&resumed));
+			resuming = 0;
+		}
+		
+		if(moving && current == goal)
+		{
+			moving = 0;
+			locked = 0;
+			LockFile(d->dev, F_UNLCK, 0);
+			if(current >= scale)
+				SaveLater(d, (current + scale/2)/scale, 0);
+		}
+		
+		/* once a second, see whether dithering is affordable */
+		if(scale > 1 && now.tv_sec - window.tv_sec >= 1)
+		{
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &used);
+			long spent = (used.tv_sec - cpu.tv_sec)*1000000L
+			           + (used.tv_nsec - cpu.tv_nsec)/1000;
+			long budget = dither_cpu_limit*1000000
+			            * ((now.tv_sec - window.tv_sec)
+			             + (now.tv_nsec - window.tv_nsec)/1e9);
+			if(dithering)
+				HistogramObserve(&metrics->dither_cpu, spent);
+			/* slow down at once, speed up only after a few calm seconds */
+			if(spent > budget/2)
+				calm = 0;
+			else if(calm < dither_calm)
+				calm++;
+			if(spent > budget)
+				period *= 2;
+			else if(calm == dither_calm && period > 1000000000L/dither_hz)
+			{
+				period /= 2;
+				calm = 0;
+			}
+			/* one doubling past dither_min_hz is off, one halving is back */
+			if(period > 2000000000L/dither_min_hz)
+				period = 2000000000L/dither_min_hz;
+			ditherable = period <= 1000000000L/dither_min_hz
+			          && !__atomic_load_n(&d->onbattery, __ATOMIC_RELAXED);
+			window = now;
+			cpu = used;
+		}
+		
+		/* when dithering is off, keep checking whether it can come back */
+		dithering = current % scale;
+		if(moving || dithering)
+		{
+			AddNs(&deadline, moving ? interval
+			               : ditherable ? period : 1000000000L);
+			ArmTimer(timer, &deadline);
+		}
+	}
+	return NULL;
+}
+
+void *
+ThermalThread(void *arg)
+{
+	/**
+	 * Watch the thermal zones and queue a cap whenever it comes on or off
+	 *
+	 * @param[in,out] *arg The Daemon
+	 *
+	 * @return             never returns
+	 */
+
+	Daemon *d = arg;
+	int capped = 0, temp;
+	int uevents = ThermalOpen();
+	Command cmd = { CMD_CAP, SRC_THERMAL, thermal_cap, 1 };
+	
+	for(;;)
+	{
+		int hot = ThermalHot(d->thermaldir, capped, &temp);
+		if(hot != capped)
+		{
+			cmd.value = hot ? thermal_cap : -1;
+			if(!Submit(d, &cmd))
+			{
+				capped = hot;
+				if(!arguments.quiet)
+					printf("%.1f C: %s\n", temp/1000.0,
+					       hot ? "capping brightness" : "lifting cap");
+				fflush(stdout);
+			}
+		}
+		ThermalWait(uevents);
+	}
+	return NULL;
+}
+
+static int
+StartMonitor(const char *bus, pid_t *pid, int quiet)
+{
+	/*
+	 * run gdbus monitor on logind, returning the read end of its output.
+	 * if quiet its errors go to /dev/null. It runs as the real user, from
+	 * a fixed path and with an empty environment, so running setuid does
+	 * not hand root to whatever PATH finds first
+	 */
+	int fds[2];
+	char *envp[] = { NULL };
+	char *argv[] = { "gdbus", "monitor", "--system", "--dest",
+	                 "org.freedesktop.login1", NULL, NULL };
+	if(bus)
+	{
+		argv[2] = "--address";
+		argv[3] = (char*)bus;
+		argv[4] = "--dest";
+		argv[5] = "org.freedesktop.login1";
+	}
+	if(pipe2(fds, O_CLOEXEC))
+		return -1;
+	*pid = fork();
+	if(*pid == 0)
+	{
+		dup2(fds[1], STDOUT_FILENO);
+		int null = quiet ? open("/dev/null", O_WRONLY|O_CLOEXEC) : -1;
+		if(null != -1)
+			dup2(null, STDERR_FILENO);
+		if(setgid(getgid()) || setuid(getuid()))
+			_exit(127);
+		execve(GDBUS, argv, envp);
+		_exit(127);
+	}
+	close(fds[1]);
+	if(*pid == -1)
+	{
+		close(fds[0]);
+		return -1;
+	}
+	return fds[0];
+}
+
+static void
+TakeInhibitor(Daemon *d)
+{
+	/*
+	 * take a logind delay lock on sleep, so a suspend waits for the level
+	 * to be saved. systemd-inhibit holds it for as long as cat runs, which
+	 * is until the pipe in d->inhibitor is closed: by the main thread once
+	 * the level is saved, or by the daemon exiting. Like gdbus it runs as
+	 * the real user from a fixed path. One that has died, say because
+	 * logind would not give the lock, is reaped and tried again
+	 */
+	static pid_t pid = -1;
+	char address[PATH_MAX];
+	char *argv[] = { "systemd-inhibit", "--what=sleep", "--mode=delay",
+	                 "--who=backlight", "--why=Saving the backlight level",
+	                 CAT, NULL };
+	char *envp[] = { NULL, NULL };
+	int fds[2];
+	
+	if(pid > 0)
+	{
+		if(__atomic_load_n(&d->inhibitor, __ATOMIC_ACQUIRE) != -1
+		&& !waitpid(pid, NULL, WNOHANG))
+			return;
+		/* released, it is on its way out */
+		int fd = __atomic_exchange_n(&d->inhibitor, -1, __ATOMIC_ACQ_REL);
+		if(fd != -1)
+			close(fd);
+		waitpid(pid, NULL, 0);
+		pid = -1;
+	}
+	if(d->bus)
+	{
+		snprintf(address, sizeof(address), "DBUS_SYSTEM_BUS_ADDRESS=%s",
+		         d->bus);
+		envp[0] = address;
+	}
+	if(pipe2(fds, O_CLOEXEC))
+		return;
+	pid = fork();
+	if(pid == 0)
+	{
+		dup2(fds[0], STDIN_FILENO);
+		int null = open("/dev/null", O_WRONLY|O_CLOEXEC);
+		if(null != -1)
+		{
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+		}
+		if(setgid(getgid()) || setuid(getuid()))
+			_exit(127);
+		execve(INHIBIT, argv, envp);
+		_exit(127);
+	}
+	close(fds[0]);
+	if(pid == -1)
+		close(fds[1]);
+	else
+		__atomic_store_n(&d->inhibitor, fds[1], __ATOMIC_RELEASE);
+}
+
+void *
+LogindThread(void *arg)
+{
+	/**
+	 * Follow logind's signals through gdbus monitor, the same way
+	 * notifications go through notify-send. Once a session has reported
+	 * IdleHint for idle_delay seconds the idle level is queued, and as soon
+	 * as it reports activity the wake is queued. Idle dimming is only
+	 * done with --idle.
+	 *
+	 * While gdbus runs, a logind delay lock on sleep is held through
+	 * TakeInhibitor. PrepareForSleep(true) queues the suspend, on which the
+	 * fade thread stops any fade and has the wanted level saved, and only
+	 * then is the lock released. PrepareForSleep(false) queues the resume
+	 * and takes the lock again. If gdbus exits, for instance because
+	 * logind restarted, it is started again, backing off while it keeps
+	 * failing to connect.
+	 *
+	 * @param[in,out] *arg The Daemon
+	 *
+	 * @return             never returns
+	 */
+
+	Daemon *d = arg;
+	Command idle = { CMD_CAP, SRC_IDLE, idle_level, 1 };
+	Command wake = { CMD_CAP, SRC_IDLE, -1, 0 };
+	Command suspend = { CMD_SLEEP, SRC_MANUAL, 0, 0 };
+	Command resume = { CMD_RESUME, SRC_MANUAL, 0, 0 };
+	char buf[4096];
+	int retry = logind_retry, failed = 0;
+	
+	for(;;)
+	{
+		/* StartMonitor leaves it alone if the pipe cannot be made */
+		pid_t pid = -1;
+		struct pollfd pfd = { StartMonitor(d->bus, &pid, failed), POLLIN, 0 };
+		int heard = 0;
+		if(pfd.fd != -1)
+			TakeInhibitor(d);
+		struct timespec idlesince;
+		int len = 0, pending = 0, dimmed = 0;
+		
+		while(pfd.fd != -1)
+		{
+			int timeout = -1;
+			if(pending)
+			{
+				long left = idle_delay*1000L - ElapsedUs(&idlesince)/1000;
+				timeout = left > 0 ? left : 0;
+			}
+			int ready = poll(&pfd, 1, timeout);
+			if(ready == 0 && pending)
+			{
+				pending = 0;
+				dimmed = !Submit(d, &idle);
+				continue;
+			}
+			if(ready < 0)
+				continue;
+			
+			ssize_t n = read(pfd.fd, buf + len, sizeof(buf)-1 - len);
+			if(n < 1)
+				break;
+			heard = 1;
+			len += n;
+			buf[len] = '\0';
+			
+			char *eol;
+			while((eol = strchr(buf, '\n')))
+			{
+				*eol = '\0';
+				/* the fade thread saves and releases once stopped */
+				if(strstr(buf, "PrepareForSleep (true"))
+				{
+					if(Submit(d, &suspend))
+						SaveLater(d, __atomic_load_n(&d->wanted,
+						                             __ATOMIC_RELAXED), 1);
+				}
+				else if(strstr(buf, "PrepareForSleep (false"))
+				{
+					clock_gettime(CLOCK_MONOTONIC, &resume.sent);
+					Submit(d, &resume);
+					TakeInhibitor(d);
+				}
+				/* both the session and the manager report it, once is enough */
+				else if(arguments.idle && strstr(buf, "'IdleHint': <true>")
+				     && !pending && !dimmed)
+				{
+					pending = 1;
+					clock_gettime(CLOCK_MONOTONIC, &idlesince);
+				}
+				else if(arguments.idle && strstr(buf, "'IdleHint': <false>"))
+				{
+					pending = 0;
+					if(dimmed && !Submit(d, &wake))
+						dimmed = 0;
+				}
+				len -= eol+1 - buf;
+				memmove(buf, eol+1, len+1);
+			}
+			if(len == sizeof(buf)-1)
+				len = 0;
+		}
+		if(pfd.fd != -1)
+			close(pfd.fd);
+		if(pid > 0)
+			waitpid(pid, NULL, 0);
+		/* a wake lost with the monitor must not leave the screen dim */
+		Submit(d, &wake);
+		if(heard)
+			retry = logind_retry;
+		else if((retry *= 2) > logind_retry_max)
+			retry = logind_retry_max;
+		failed = !heard;
+		sleep(retry);
+	}
+	return NULL;
+}
+
+/**
+ * A connected client and the part of a line it has sent so far
+ */
+typedef struct {
+	int             fd;
+	int             len;
+	char            buf[128];
+	Bucket          bucket;
+} Client;
+
+void
+BucketInit(Bucket *b, double burst, const struct timespec *now)
+{
+	b->tokens = burst;
+	b->last   = *now;
+}
+
+int
+BucketWait(Bucket *b, double rate, double burst, const struct timespec *now)
+{
+	/**
+	 * Top up a token bucket for the time gone by
+	 *
+	 * @param[in,out] *b     The bucket
+	 * @param[in]     rate   Tokens added a second
+	 * @param[in]     burst  Most tokens it holds
+	 * @param[in]     *now   The monotonic time
+	 *
+	 * @return               0 if a token can be taken, otherwise the
+	 *                       milliseconds until one can
+	 */
+
+	b->tokens += rate*((now->tv_sec - b->last.tv_sec)
+	                 + (now->tv_nsec - b->last.tv_nsec)/1e9);
+	if(b->tokens > burst)
+		b->tokens = burst;
+	b->last = *now;
+	return b->tokens >= 1 ? 0 : (int)ceil((1 - b->tokens)*1000/rate);
+}
+
+void
+Coalesce(Command *held, const Command *cmd)
+{
+	/**
+	 * Fold a newer request into one held back for the same source. A
+	 * change in the same unit adds to what was held, anything else
+	 * replaces it.
+	 *
+	 * @param[in,out] *held The request held
+	 * @param[in]     *cmd  The newer request
+	 */
+
+	int change = cmd->type == CMD_INC ? cmd->value : -cmd->value;
+	MetricAdd(&metrics->coalesced, 1);
+	if((cmd->type != CMD_INC && cmd->type != CMD_DEC)
+	|| held->type == CMD_CLEAR || held->percent != cmd->percent)
+		*held = *cmd;
+	else if(held->type == CMD_SET)
+		held->value = held->value + change < 0 ? 0 : held->value + change;
+	else
+	{
+		change += held->type == CMD_INC ? held->value : -held->value;
+		held->type  = change < 0 ? CMD_DEC : CMD_INC;
+		held->value = abs(change);
+	}
+}
+
+static int
+Admit(Daemon *d, Client *c, const Command *cmd)
+{
+	/**
+	 * Pass a client's request on if neither its own nor its source's
+	 * bucket is empty, otherwise hold it for Release. Requests are held
+	 * per source, whichever connection sent them. One arriving while an
+	 * earlier one of its source is held, from any connection, is coalesced
+	 * with it, so it can neither overtake it nor be overtaken by it.
+	 *
+	 * @param[in,out] *d   The daemon
+	 * @param[in,out] *c   The client sending it
+	 * @param[in]     *cmd The request
+	 *
+	 * @return             0 if queued or held; -1 if the queue is full
+	 */
+
+	struct timespec now;
+	int src = cmd->source;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	if(d->holding & 1u << src)
+	{
+		Coalesce(&d->held[src], cmd);
+		return 0;
+	}
+	int client = BucketWait(&c->bucket, client_rate, client_burst, &now);
+	int source = BucketWait(&d->limit[src], source_rate, source_burst, &now);
+	if(client || source)
+	{
+		MetricAdd(&metrics->throttled[client ? LIMIT_CLIENT : LIMIT_SOURCE], 1);
+		d->held[src] = *cmd;
+		d->holding |= 1u << src;
+		return 0;
+	}
+	c->bucket.tokens--;
+	d->limit[src].tokens--;
+	return Submit(d, cmd);
+}
+
+static int
+Release(Daemon *d)
+{
+	/**
+	 * Pass on the held requests their source's bucket now allows. The
+	 * connection that sent one may be gone by then, and the client bucket
+	 * it went over has done its part by holding it
+	 *
+	 * @param[in,out] *d The daemon
+	 *
+	 * @return           milliseconds until a held request may go, -1 if
+	 *                   none is held
+	 */
+
+	struct timespec now;
+	int timeout = -1, src, wait;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	for(src = 0; src < TARGET_SOURCES; src++)
+	{
+		if(!(d->holding & 1u << src))
+			continue;
+		wait = BucketWait(&d->limit[src], source_rate, source_burst, &now);
+		/* queue full, try again shortly */
+		if(!wait && Submit(d, &d->held[src]))
+			wait = 10;
+		if(wait)
+		{
+			timeout = timeout < 0 || wait < timeout ? wait : timeout;
+			continue;
+		}
+		d->limit[src].tokens--;
+		d->holding &= ~(1u << src);
+	}
+	return timeout;
+}
+
+static int
+FindSource(const char *name)
+{
+	int i;
+	for(i = 0; i < TARGET_SOURCES; i++)
+		if(!strcmp(name, source_names[i]))
+			return i;
+	return -1;
+}
+
+static int
+HandleRequest(Daemon *d, Client *c, char *line)
+{
+	/* returns -1 when the client should be disconnected */
+	int fd = c->fd;
+	Command cmd = { 0, SRC_MANUAL, 0, 0 };
+	char reply[32], word[16], source[16];
+	int n = 0;
+	
+	if(sscanf(line, "%15s %i%n", word, &cmd.value, &n) == 2 && cmd.value >= 0)
+	{
+		cmd.percent = line[n] == '%';
+		if(sscanf(line + n + cmd.percent, "%15s", source) == 1)
+			cmd.source = FindSource(source);
+		
+		if(!strcmp(word, "set"))
+			cmd.type = CMD_SET;
+		else if(!strcmp(word, "inc"))
+			cmd.type = CMD_INC;
+		else if(!strcmp(word, "dec"))
+			cmd.type = CMD_DEC;
+		else
+			cmd.source = -1;
+		if(cmd.source < 0 || (cmd.type != CMD_SET && cmd.source))
+			return dprintf(fd, "error unknown request\n") < 0 ? -1 : 0;
+		MetricAdd(&metrics->requests[cmd.type == CMD_SET ? REQ_SET
+		                           : cmd.type == CMD_INC ? REQ_INC
+		                                                 : REQ_DEC], 1);
+		return dprintf(fd, Admit(d, c, &cmd) ? "busy\n" : "ok\n") < 0 ? -1 : 0;
+	}
+	if(sscanf(line, "%15s %15s", word, source) == 2 && !strcmp(word, "clear"))
+	{
+		cmd.type = CMD_CLEAR;
+		if((cmd.source = FindSource(source)) < 0)
+			return dprintf(fd, "error unknown source\n") < 0 ? -1 : 0;
+		return dprintf(fd, Admit(d, c, &cmd) ? "busy\n" : "ok\n") < 0 ? -1 : 0;
+	}
+	if(sscanf(line, "%15s", word) == 1 && !strcmp(word, "get"))
+	{
+		MetricAdd(&metrics->requests[REQ_READ], 1);
+		n = sprintf(reply, "%i %i\n",
+		            __atomic_load_n(&d->current, __ATOMIC_RELAXED),
+		            d->max_brightness);
+		return send(fd, reply, n, MSG_NOSIGNAL) == n ? 0 : -1;
+	}
+	if(sscanf(line, "%15s", word) == 1 && !strcmp(word, "metrics"))
+	{
+		char *text = NULL;
+		size_t size = 0;
+		FILE *theFile = open_memstream(&text, &size);
+		PrintMetrics(theFile, metrics);
+		fclose(theFile);
+		n = send(fd, text, size, MSG_NOSIGNAL) == (ssize_t)size ? 0 : -1;
+		free(text);
+		return n;
+	}
+	return dprintf(fd, "error unknown request\n") < 0 ? -1 : 0;
+}
+
+static int
+DaemonConnect(void)
+{
+	/* returns a socket connected to the daemon, -1 if there is none */
+	struct sockaddr_un addr = { AF_UNIX, SOCKET_FILE };
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if(fd != -1 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+	{
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+int
+RunDaemon(Device *dev, char *thermaldir)
+{
+	/**
+	 * Start the fade and logind threads, and the thermal thread if asked
+	 * for, then serve clients on SOCKET_FILE. Each line a client sends is
+	 * one of "set N", "inc N" or "dec N", N optionally followed by %, answered
+	 * with "ok" once queued; "get", answered with the level and the
+	 * maximum; or "metrics", answered with the metrics. "set" may name the
+	 * source asking, manual, schedule or ambient, and "clear SOURCE" drops
+	 * what that source asked for. These are rate limited, per connection
+	 * and per source, by Admit. A daemon answering on SOCKET_FILE, or one
+	 * holding DaemonLock on the device, keeps another from starting.
+	 *
+	 * @param[in] *dev        The device to drive
+	 * @param[in] *thermaldir The thermal zone directory, NULL for no cap
+	 *
+	 * @return                EXIT_FAILURE if the daemon could not start
+	 */
+
+	static Daemon d;
+	pthread_t fader, thermal, logind;
+	struct timespec now;
+	int i, timeout = -1;
+	
+	d.dev = dev;
+	d.thermaldir = thermaldir;
+	d.bus = arguments.bus;
+	d.max_brightness = ReadSysFile(dev->max_brightness);
+	d.current = d.wanted = dev->cached = ReadSysFile(dev->brightness);
+	if(d.max_brightness < 0 || d.current < 0)
+		return EXIT_FAILURE;
+	
+	/* the socket is shared by all, the device must have a single driver */
+	int other = DaemonConnect();
+	if(other != -1 || DaemonLock(dev))
+	{
+		if(other != -1)
+			close(other);
+		printf("A daemon is already running\n");
+		return EXIT_FAILURE;
+	}
+	
+	int wake = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	d.saver = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	d.inhibitor = -1;
+	QueueInit(&d.queue[QOS_INTERACTIVE], wake);
+	QueueInit(&d.queue[QOS_BACKGROUND], wake);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for(i = 0; i < TARGET_SOURCES; i++)
+		BucketInit(&d.limit[i], source_burst, &now);
+	struct timespec powered = now;
+	d.onbattery = arguments.dither && OnBattery();
+	if(!(d.ring = RingOpen(d.max_brightness)) && !arguments.quiet)
+		printf("Couldn't map %s, not publishing changes\n", RingFile());
+	
+	struct sockaddr_un addr = { AF_UNIX, SOCKET_FILE };
+	int listener = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	unlink(SOCKET_FILE);
+	if(listener == -1 || wake == -1 || d.saver == -1
+	|| bind(listener, (struct sockaddr*)&addr, sizeof(addr))
+	|| chmod(SOCKET_FILE, 0666) || listen(listener, 16))
+	{
+		printf("Couldn't listen on %s\n", SOCKET_FILE);
+		return EXIT_FAILURE;
+	}
+	/*
+	 * a client that hangs up before its answer gets EPIPE, not the daemon
+	 * killed, and one that stops reading is dropped when its socket fills
+	 */
+	signal(SIGPIPE, SIG_IGN);
+	
+	if(pthread_create(&fader, NULL, FadeThread, &d)
+	|| (thermaldir && pthread_create(&thermal, NULL, ThermalThread, &d))
+	|| pthread_create(&logind, NULL, LogindThread, &d))
+	{
+		printf("Couldn't start threads\n");
+		return EXIT_FAILURE;
+	}
+	
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev);
+	ev.data.ptr = &d;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, d.saver, &ev);
+	
+	for(;;)
+	{
+		/* the fade thread only reads the flag, the globbing is done here */
+		int wait = timeout;
+		if(arguments.dither)
+		{
+			long left = power_poll_ms - (long)(ElapsedUs(&powered)/1000);
+			if(left <= 0)
+			{
+				__atomic_store_n(&d.onbattery, OnBattery(), __ATOMIC_RELAXED);
+				clock_gettime(CLOCK_MONOTONIC, &powered);
+				left = power_poll_ms;
+			}
+			wait = wait < 0 || left < wait ? left : wait;
+		}
+		int ready = epoll_wait(epfd, &ev, 1, wait);
+		timeout = Release(&d);
+		if(ready < 1)
+			continue;
+		
+		/* the state file is written here, keeping its syncs off the fader */
+		if(ev.data.ptr == &d)
+		{
+			uint64_t count;
+			if(read(d.saver, &count, sizeof(count)) == sizeof(count))
+			{
+				int level = __atomic_exchange_n(&d.save, 0, __ATOMIC_ACQUIRE);
+				if(level > 0)
+					SaveState(dev, level);
+				/* saved and stopped, the suspend can go ahead */
+				int held = __atomic_exchange_n(&d.release, 0, __ATOMIC_ACQUIRE)
+				         ? __atomic_exchange_n(&d.inhibitor, -1, __ATOMIC_ACQ_REL)
+				         : -1;
+				if(held != -1)
+					close(held);
+			}
+			continue;
+		}
+		
+		if(!ev.data.ptr)
+		{
+			Client *c = malloc(sizeof(Client));
+			c->fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+			c->len = 0;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			BucketInit(&c->bucket, client_burst, &now);
+			ev.events = EPOLLIN;
+			ev.data.ptr = c;
+			if(c->fd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev))
+			{
+				if(c->fd != -1)
+					close(c->fd);
+				free(c);
+				continue;
+			}
+			continue;
+		}
+		
+		Client *c = ev.data.ptr;
+		ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf)-1 - c->len);
+		int drop = !n || (n < 0 && errno != EAGAIN && errno != EINTR);
+		if(n > 0)
+			c->len += n;
+		
+		char *eol;
+		while(!drop && (eol = memchr(c->buf, '\n', c->len)))
+		{
+			*eol = '\0';
+			drop = HandleRequest(&d, c, c->buf) < 0;
+			c->len -= eol+1 - c->buf;
+			memmove(c->buf, eol+1, c->len);
+		}
+		/* what it had held stays with the daemon */
+		if(drop || c->len == sizeof(c->buf)-1)
+		{
+			close(c->fd);
+			free(c);
+		}
+		timeout = Release(&d);
+	}
+}
+
+int
+SendToDaemon(void)
+{
+	/**
+	 * Pass the request given on the command line to the daemon and print
+	 * its answer. With no set, inc or dec, ask it for the level.
+	 *
+	 * @return EXIT_SUCCESS if the daemon took the request
+	 */
+
+	char request[32], reply[4096];
+	const char *percent = arguments.percent ? "%" : "";
 	
-	/* try to create a file lock */
-	if(fcntl(fd, (l_type == F_WRLCK ? F_SETLKW : F_SETLK), &fl) == -1)
+	if(arguments.set >= 0)
+		sprintf(request, "set %i%s\n", arguments.set, percent);
+	else if(arguments.inc >= 0)
+		sprintf(request, "inc %i%s\n", arguments.inc, percent);
+	else if(arguments.dec >= 0)
+		sprintf(request, "dec %i%s\n", arguments.dec, percent);
+	else if(arguments.tog)
 	{
-		if(errno == EDEADLK)
-			exit(EXIT_FAILURE); /* whoops */
-		if(errno == EINTR || errno == EACCES || errno == EAGAIN)
-			return -1;
+		printf("Toggle is not supported by the daemon\n");
+		return EXIT_FAILURE;
+	}
+	else
+		sprintf(request, "get\n");
+	
+	int fd = DaemonConnect();
+	if(fd == -1)
+	{
+		if(!arguments.quiet)
+			printf("Couldn't connect to the daemon on %s\n", SOCKET_FILE);
+		return EXIT_FAILURE;
+	}
+	ssize_t n = -1;
+	if(write(fd, request, strlen(request)) == (ssize_t)strlen(request))
+		n = read(fd, reply, sizeof(reply)-1);
+	close(fd);
+	if(n < 1)
+		return EXIT_FAILURE;
+	reply[n] = '\0';
+	
+	int level, max;
+	if(sscanf(reply, "%i %i", &level, &max) == 2)
+	{
+		if(!arguments.quiet)
+			printf("Max brightness = %i\nCurrent brightness = %i\n",
+			       max, level);
+		return EXIT_SUCCESS;
 	}
-	if(l_type == F_UNLCK)
+	if(!arguments.quiet)
+		printf("%s", reply);
+	return strncmp(reply, "ok", 2) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* connections asking the daemon for its level while --stress loads it */
+#define STRESS_CLIENTS 8
+
+static void *
+StressLoad(void *arg)
+{
+	/* ask for the level until told to stop, returns the answers had */
+	int *stop = arg;
+	char reply[64];
+	unsigned long answers = 0;
+	
+	int fd = DaemonConnect();
+	while(fd != -1 && !__atomic_load_n(stop, __ATOMIC_RELAXED)
+	&& write(fd, "get\n", 4) == 4 && read(fd, reply, sizeof(reply)) > 0)
+		answers++;
+	if(fd != -1)
 		close(fd);
-	return 0;
+	return (void*)answers;
+}
+
+static void
+JitterReport(const char *phase, const Histogram *before)
+{
+	/* print the step jitter observed since before was taken */
+	unsigned long delta[METRIC_BUCKETS + 1], count = 0, seen = 0;
+	unsigned int i;
+	
+	for(i = 0; i <= METRIC_BUCKETS; i++)
+		count += delta[i] = __atomic_load_n(&metrics->step_jitter.bucket[i],
+		                                    __ATOMIC_RELAXED) - before->bucket[i];
+	if(!count)
+	{
+		printf("%s: no fade steps seen, is the daemon using %s?\n", phase,
+		       METRICS_FILE);
+		return;
+	}
+	for(i = 0; i < METRIC_BUCKETS && (seen += delta[i]) < count*0.99; i++)
+		;
+	printf("%s: %lu steps, mean jitter %lu us, p99 ", phase, count,
+	       (__atomic_load_n(&metrics->step_jitter.sum, __ATOMIC_RELAXED)
+	        - before->sum)/count);
+	if(i < METRIC_BUCKETS)
+		printf("<= %lu us\n", metric_buckets[i]);
+	else
+		printf("> %lu us\n", metric_buckets[METRIC_BUCKETS-1]);
+}
+
+int
+StressDaemon(int seconds)
+{
+	/**
+	 * Keep the daemon fading between 25% and 75% for seconds, once alone
+	 * and once while STRESS_CLIENTS connections ask it for the level as
+	 * fast as it answers, and report the fade step jitter of each from the
+	 * shared metrics
+	 *
+	 * @param[in] seconds How long to run each
+	 *
+	 * @return            EXIT_SUCCESS if the daemon kept answering
+	 */
+
+	struct timespec start, pause = { 0, 2*fade_time*1000000L };
+	pthread_t load[STRESS_CLIENTS];
+	Histogram before;
+	char reply[64];
+	int stop, phase, i, loaders = 0;
+	unsigned long answers = 0;
+	
+	int fd = DaemonConnect();
+	if(fd == -1)
+	{
+		printf("Couldn't connect to the daemon on %s\n", SOCKET_FILE);
+		return EXIT_FAILURE;
+	}
+	for(phase = 0; phase < 2; phase++)
+	{
+		stop = 0;
+		if(phase)
+			for(loaders = 0; loaders < STRESS_CLIENTS; loaders++)
+				if(pthread_create(&load[loaders], NULL, StressLoad, &stop))
+					break;
+		memcpy(&before, &metrics->step_jitter, sizeof(before));
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(i = 0; ElapsedUs(&start) < seconds*1000000UL; i++)
+		{
+			if(write(fd, i % 2 ? "set 25%\n" : "set 75%\n", 8) != 8
+			|| read(fd, reply, sizeof(reply)) < 1)
+			{
+				printf("The daemon stopped answering\n");
+				return EXIT_FAILURE;
+			}
+			nanosleep(&pause, NULL);
+		}
+		__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+		for(i = 0; i < loaders; i++)
+		{
+			void *took;
+			pthread_join(load[i], &took);
+			answers += (unsigned long)took;
+		}
+		JitterReport(phase ? "Loaded" : "Idle", &before);
+	}
+	close(fd);
+	printf("%i clients had %lu answers, %lu a second\n", loaders, answers,
+	       answers/seconds);
+	return EXIT_SUCCESS;
+}
+
+int
+RecordRequest(char *theFileName, const struct timespec *arrival,
+              int before, int after)
+{
+	/**
+	 * Append the current request to a trace file as one line holding the
+	 * wall clock arrival time, the brightness before and after the request
+	 * and the options that decided the change. Lines are written while the
+	 * lock is held, so the file lists requests in the order they were
+	 * applied.
+	 *
+	 * @param[in] *theFileName A zero terminated string containing the name
+	 *                         and path of the trace file
+	 * @param[in] *arrival     When the request arrived
+	 * @param[in] before       The brightness before the request
+	 * @param[in] after        The brightness after the request
+	 *
+	 * @return                 0 is success; negative integer is failure
+	 */
+
+	char line[128];
+	int len = sprintf(line, "%lld.%06ld %i %i", (long long)arrival->tv_sec,
+	                  arrival->tv_nsec/1000, before, after);
+	if(arguments.tog)
+		len += sprintf(line+len, " -t");
+	if(arguments.inc >= 0)
+		len += sprintf(line+len, " -i %i", arguments.inc);
+	if(arguments.dec >= 0)
+		len += sprintf(line+len, " -d %i", arguments.dec);
+	if(arguments.set >= 0)
+		len += sprintf(line+len, " -s %i", arguments.set);
+	if(arguments.percent)
+		len += sprintf(line+len, " -p");
+	line[len++] = '\n';
+	
+	/* a single append keeps lines from concurrent runs whole */
+	int fd = open(theFileName, O_WRONLY|O_APPEND|O_CREAT, 0644);
+	if(fd == -1)
+		return -1;
+	int rval = write(fd, line, len) == len ? 0 : -2;
+	close(fd);
+	return rval;
+}
+
+/**
+ * One request read back from a trace file
+ */
+typedef struct {
+	unsigned long at;     /**< arrival in microseconds after the first one */
+	int before;           /**< brightness before it was applied */
+	int after;            /**< brightness after it was applied */
+	char *args[8];        /**< its options, NULL terminated */
+	pid_t pid;            /**< the process replaying it */
+	struct timespec sent; /**< when that process was started */
+	unsigned long took;   /**< end to end latency in microseconds */
+} TraceEntry;
+
+static int
+CompareArrival(const void *a, const void *b)
+{
+	const TraceEntry *x = a, *y = b;
+	return (x->at > y->at) - (x->at < y->at);
+}
+
+static int
+CompareUlong(const void *a, const void *b)
+{
+	const unsigned long *x = a, *y = b;
+	return (*x > *y) - (*x < *y);
+}
+
+int
+Replay(char *theFileName, double speed, char *prog)
+{
+	/**
+	 * Play a trace recorded with --record back against the device. Every
+	 * request is started as its own process at its recorded offset divided
+	 * by speed, so requests overlap and contend for the lock the way they
+	 * did when recorded. The device is first set to the value the recording
+	 * started from, and at the end is expected to hold the value the
+	 * recording finished with.
+	 *
+	 * @param[in] *theFileName A zero terminated string containing the name
+	 *                         and path of the trace file
+	 * @param[in] speed        How many times faster than recorded to play
+	 * @param[in] *prog        The name to start the request processes with
+	 *
+	 * @return                 EXIT_SUCCESS if the final brightness matched
+	 */
+
+	FILE *theFile = fopen(theFileName, "r");
+	if(!theFile)
+	{
+		fprintf(stderr, "Could not open the trace %s\n", theFileName);
+		return EXIT_FAILURE;
+	}
+	
+	TraceEntry *trace = NULL;
+	int n = 0, size = 0;
+	char *line = NULL;
+	size_t bufferSize = 0;
+	long long sec;
+	long usec;
+	int pos;
+	
+	while(getline(&line, &bufferSize, theFile) > 0)
+	{
+		if(n == size)
+		{
+			size = size ? size*2 : 64;
+			trace = realloc(trace, size*sizeof(TraceEntry));
+		}
+		TraceEntry *e = &trace[n];
+		memset(e, 0, sizeof(*e));
+		if(sscanf(line, "%lld.%ld %i %i %n", &sec, &usec,
+		          &e->before, &e->after, &pos) < 4)
+			continue;
+		e->at = sec*1000000UL + usec;
+		
+		int i = 0;
+		char *arg = strtok(strdup(line+pos), " \n");
+		while(arg && i < 7)
+		{
+			e->args[i++] = arg;
+			arg = strtok(NULL, " \n");
+		}
+		n++;
+	}
+	free(line);
+	fclose(theFile);
+	if(!n)
+	{
+		fprintf(stderr, "No requests in the trace %s\n", theFileName);
+		return EXIT_FAILURE;
+	}
+	
+	/* the file is in the order requests were applied */
+	int initial = trace[0].before, expected = trace[n-1].after;
+	if(SetTo(device.brightness, initial) < 0)
+	{
+		fprintf(stderr, "Could not write to %s\n", device.brightness);
+		return EXIT_FAILURE;
+	}
+	
+	qsort(trace, n, sizeof(TraceEntry), CompareArrival);
+	unsigned long first = trace[0].at;
+	for(pos = 0; pos < n; pos++)
+		trace[pos].at = (trace[pos].at - first)/speed;
+	
+	/* count the writes the replay makes in metrics of its own */
+	char statename[64];
+	sprintf(statename, "/tmp/brightREPLAY.%i", getpid());
+	setenv("BACKLIGHT_METRICS", statename, 1);
+	Metrics *counted = MetricsOpen(statename);
+	
+	sigset_t mask, oldmask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	struct pollfd pfd = { signalfd(-1, &mask, SFD_CLOEXEC), POLLIN, 0 };
+	
+	struct timespec start, now, wait;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int next = 0, done = 0, failed = 0;
+	
+	while(done < n)
+	{
+		wait.tv_sec = -1;
+		if(next < n)
+		{
+			unsigned long due = trace[next].at, elapsed = ElapsedUs(&start);
+			if(elapsed >= due)
+			{
+				char *childargv[12] = { prog, "-q", "-D", device.dir };
+				memcpy(childargv+4, trace[next].args, sizeof(trace->args));
+				clock_gettime(CLOCK_MONOTONIC, &trace[next].sent);
+				trace[next].pid = fork();
+				if(trace[next].pid == 0)
+				{
+					sigprocmask(SIG_SETMASK, &oldmask, NULL);
+					execv("/proc/self/exe", childargv);
+					_exit(127);
+				}
+				if(trace[next].pid == -1)
+				{
+					failed++;
+					done++;
+				}
+				next++;
+				continue;
+			}
+			wait.tv_sec  = (due - elapsed)/1000000;
+			wait.tv_nsec = (due - elapsed)%1000000*1000;
+		}
+		
+		if(ppoll(&pfd, 1, wait.tv_sec < 0 ? NULL : &wait, NULL) < 1)
+			continue;
+		struct signalfd_siginfo info;
+		read(pfd.fd, &info, sizeof(info));
+		
+		int status;
+		pid_t pid;
+		while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			for(pos = 0; pos < next && trace[pos].pid != pid; pos++);
+			if(pos == next)
+				continue;
+			trace[pos].took = ElapsedUs(&trace[pos].sent);
+			if(!WIFEXITED(status) || WEXITSTATUS(status))
+				failed++;
+			done++;
+		}
+	}
+	close(pfd.fd);
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	unsigned long total = ElapsedUs(&start);
+	
+	unsigned long *latency = malloc(n*sizeof(unsigned long));
+	for(pos = 0; pos < n; pos++)
+		latency[pos] = trace[pos].took;
+	qsort(latency, n, sizeof(unsigned long), CompareUlong);
+	
+	int final = ReadSysFile(device.brightness);
+	printf("Replayed %i requests in %.3f ms at %gx\n", n, total/1e3, speed);
+	printf("Latency (ms): p50 %.3f  p95 %.3f  p99 %.3f  max %.3f\n",
+	       latency[n/2]/1e3, latency[n*95/100]/1e3, latency[n*99/100]/1e3,
+	       latency[n-1]/1e3);
+	printf("Sysfs writes = %lu\n",
+	       __atomic_load_n(&counted->sysfs_write.count, __ATOMIC_RELAXED));
+	printf("Failed requests = %i\n", failed);
+	printf("Final brightness = %i, expected %i (%s)\n", final, expected,
+	       final == expected ? "ok" : "MISMATCH");
+	
+	unlink(statename);
+	free(latency);
+	return final == expected && !failed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * One device of a run on several, faded by a thread of its own
+ */
+typedef struct {
+	Device *dev;
+	int     max_brightness; /**< -1 if it could not be read */
+	int     brightness;     /**< the level it was left at */
+	int     failed;
+	int     save;           /**< set if the level is to be saved */
+} DeviceRun;
+
+static void *
+RunDevice(void *arg)
+{
+	/**
+	 * Apply the set, inc or dec given on the command line to one device,
+	 * whose lock the caller holds
+	 *
+	 * @param[in,out] *arg The DeviceRun
+	 *
+	 * @return             NULL
+	 */
+
+	DeviceRun *run = arg;
+	Device *dev = run->dev;
+	int max_brightness = run->max_brightness = ReadSysFile(dev->max_brightness);
+	int brightness = run->brightness = ReadSysFile(dev->brightness);
+	if(max_brightness < 0 || brightness < 0)
+	{
+		run->max_brightness = -1;
+		run->failed = 1;
+		return NULL;
+	}
+	dev->cached = brightness;
+	
+	int target = brightness;
+	double scale = arguments.percent ? max_brightness/100.0 : 1;
+	if(arguments.set >= 0)
+		target = (int)round(arguments.set*scale);
+	else if(arguments.inc >= 0)
+		target += (int)round(arguments.inc*scale);
+	else if(arguments.dec >= 0)
+		target -= (int)round(arguments.dec*scale);
+	target = Clamp(target, lower_limit, max_brightness);
+	MetricAdd(&metrics->requests[arguments.set >= 0 ? REQ_SET
+	                           : arguments.inc >= 0 ? REQ_INC
+	                           : arguments.dec >= 0 ? REQ_DEC
+	                                                : REQ_READ], 1);
+	
+	if(target != brightness)
+	{
+		int chars = CheckPerm(dev->brightness) ? -1
+		          : FadeTo(dev, brightness, target - brightness);
+		if(chars < 0)
+		{
+			MetricAdd(&metrics->errors[chars == -1 ? ERR_OPEN
+			                         : chars == -3 ? ERR_SLEEP
+			                                       : ERR_WRITE], 1);
+			run->failed = 1;
+		}
+		brightness = run->brightness = ReadSysFile(dev->brightness);
+		run->save = chars >= 0 && brightness > 0;
+	}
+	return NULL;
+}
+
+int
+RunOnDevices(int n)
+{
+	/**
+	 * Apply the set, inc or dec given on the command line to every device
+	 * given with -D, or just report them. Their locks are all held
+	 * throughout, so no one sees some devices changed and others not. Each
+	 * device is faded by a thread of its own, so they all fade together
+	 * and the run takes one fade_time rather than one per device.
+	 *
+	 * @param[in] n The number of devices
+	 *
+	 * @return      EXIT_SUCCESS if every device was read and written
+	 */
+
+	Device *devs[MAX_DEVICES];
+	DeviceRun runs[MAX_DEVICES];
+	pthread_t threads[MAX_DEVICES];
+	int started[MAX_DEVICES];
+	int i, failed = 0;
+	
+	if(arguments.tog || arguments.notify || arguments.iconpath)
+	{
+		printf("Toggle and notifications work on a single device\n");
+		return EXIT_FAILURE;
+	}
+	
+	for(i = 0; i < n; i++)
+		devs[i] = i ? &others[i-1] : &device;
+	struct timespec lockstart;
+	clock_gettime(CLOCK_MONOTONIC, &lockstart);
+	if(LockDevices(devs, n, F_WRLCK) == -1)
+	{
+		MetricAdd(&metrics->errors[ERR_LOCK], 1);
+		printf("Failed lock\n");
+		return EXIT_FAILURE;
+	}
+	HistogramObserve(&metrics->lock_wait, ElapsedUs(&lockstart));
+	
+	for(i = 0; i < n; i++)
+	{
+		runs[i] = (DeviceRun){ devs[i], -1, -1, 0, 0 };
+		/* the same device twice, maybe through a link, only changes once */
+		started[i] = 0;
+		if(i && !strcmp(devs[i]->lock, devs[i-1]->lock))
+			continue;
+		/* a thread that can't be had leaves the device to this one */
+		started[i] = pthread_create(&threads[i], NULL, RunDevice, &runs[i])
+		           ? -1 : 1;
+	}
+	for(i = 0; i < n; i++)
+	{
+		if(started[i] > 0)
+			pthread_join(threads[i], NULL);
+		else if(started[i] < 0)
+			RunDevice(&runs[i]);
+		else
+			continue;
+		failed |= runs[i].failed;
+		if(!arguments.quiet && runs[i].max_brightness >= 0)
+			printf("%s: Max brightness = %i, Current brightness = %i\n",
+			       devs[i]->dir, runs[i].max_brightness, runs[i].brightness);
+	}
+	LockDevices(devs, n, F_UNLCK);
+	for(i = 0; i < n; i++)
+		if(runs[i].save)
+			SaveCurrent(devs[i]);
+	
+	if(arguments.metrics && WriteMetrics(arguments.metrics, metrics) < 0
+	&& !arguments.quiet)
+		printf("Couldn't write metrics to %s\n", arguments.metrics);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 int
@@ -490,19 +3705,14 @@ main (int argc, char** argv)
 	 *                      program. 0 means success.
 	 */
 	
-	if(SetLock(F_WRLCK) == -1)
-	{
-		printf("Failed lock\n");
-		return EXIT_FAILURE;
-	}
-
-	int max_brightness = ReadSysFile(MAX_BRIGHTNESS);
-	if (max_brightness < 0)
-		exit(EXIT_FAILURE);
+	struct timespec arrival;
+	clock_gettime(CLOCK_REALTIME, &arrival);
+	int i;
+	elevated = getuid() != geteuid();
 	
-	int brightness = ReadSysFile(BRIGHTNESS);
-	if (brightness < 0 || brightness > max_brightness)
-		exit(EXIT_FAILURE);
+	/* the replay harness points its requests at metrics of its own */
+	char *metricsfile = elevated ? NULL : getenv("BACKLIGHT_METRICS");
+	metrics = MetricsOpen(metricsfile ? metricsfile : METRICS_FILE);
 
 	/* booleans */
 	arguments.verbose 	= 0;
@@ -511,6 +3721,21 @@ main (int argc, char** argv)
 	arguments.iconpath 	= 0;
 	arguments.percent 	= 0;
 	arguments.tog 		= 0;
+	arguments.metrics	= NULL;
+	arguments.devices	= 0;
+	arguments.record	= NULL;
+	arguments.replay	= NULL;
+	arguments.speed 	= 1;
+	arguments.profile	= 0;
+	arguments.thermal	= 0;
+	arguments.thermaldir	= NULL;
+	arguments.daemon	= 0;
+	arguments.client	= 0;
+	arguments.idle  	= 0;
+	arguments.bus   	= NULL;
+	arguments.follow	= 0;
+	arguments.dither	= 0;
+	arguments.stress	= 0;
 
 	/* ints */
 	arguments.set = -1;
@@ -518,9 +3743,84 @@ main (int argc, char** argv)
 	arguments.dec = -1;
 	
 	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+	
+	if(elevated && (arguments.metrics || arguments.record || arguments.replay))
+	{
+		printf("-m, --record and --replay are not allowed when running "
+		       "setuid\n");
+		return EXIT_FAILURE;
+	}
+	
+	/* these drive, or talk about, a single device */
+	if(arguments.devices > 1 && (arguments.replay || arguments.client
+	|| arguments.follow || arguments.daemon || arguments.thermal))
+	{
+		printf("Only one -D can be given with --daemon, --thermal, --replay, "
+		       "--follow or -c\n");
+		return EXIT_FAILURE;
+	}
+	
+	for(i = 0; i < (arguments.devices ? arguments.devices : 1); i++)
+	{
+		char real[PATH_MAX];
+		const char *dir = arguments.devices ? arguments.device[i] : DEVICE_DIR;
+		if(elevated && arguments.devices)
+			dir = DeviceAllowed(dir, real) ? real : NULL;
+		if(!dir || DeviceInit(i ? &others[i-1] : &device, dir) < 0)
+		{
+			printf("Invalid device directory\n");
+			return EXIT_FAILURE;
+		}
+	}
+	
+	if(arguments.replay)
+		return Replay(arguments.replay, arguments.speed, argv[0]);
+	
+	if(arguments.client)
+		return arguments.stress > 0 ? StressDaemon(arguments.stress)
+		                            : SendToDaemon();
+	
+	if(arguments.follow)
+		return Follow();
+	
+	if(arguments.daemon)
+		return RunDaemon(&device, !arguments.thermal ? NULL
+		                        : arguments.thermaldir ? arguments.thermaldir
+		                                               : THERMAL_DIR);
+	
+	if(arguments.thermal)
+		return ThermalWatch(&device, arguments.thermaldir
+		                             ? arguments.thermaldir : THERMAL_DIR);
+	
+	if(arguments.devices > 1)
+		return RunOnDevices(arguments.devices);
+	
+	if(arguments.profile)
+		ProfileStart(&profile);
+	
+	struct timespec lockstart;
+	clock_gettime(CLOCK_MONOTONIC, &lockstart);
+	if(SetLock(&device, F_WRLCK) == -1)
+	{
+		MetricAdd(&metrics->errors[ERR_LOCK], 1);
+		printf("Failed lock\n");
+		return EXIT_FAILURE;
+	}
+	HistogramObserve(&metrics->lock_wait, ElapsedUs(&lockstart));
+	ProfileMark(&profile, "lock");
+
+	int max_brightness = ReadSysFile(device.max_brightness);
+	if (max_brightness < 0)
+		exit(EXIT_FAILURE);
+	
+	int brightness = ReadSysFile(device.brightness);
+	if (brightness < 0 || brightness > max_brightness)
+		exit(EXIT_FAILURE);
+	device.cached = brightness;
 
 	if(argc == 1)
 	{
+		MetricAdd(&metrics->requests[REQ_READ], 1);
 		printf("Max brightness = %i\n",max_brightness);
 		printf("Current brightness = %i\n",brightness);
 		return 0;
@@ -530,7 +3830,7 @@ main (int argc, char** argv)
 	
 	int totalPassive = arguments.verbose + arguments.notify
 	                 + arguments.percent + arguments.iconpath
-	                 + arguments.quiet;
+	                 + arguments.quiet + (arguments.metrics != NULL);
 	
 	int totalNonPassive = (arguments.inc >= 0) + (arguments.dec >= 0)
 	                    + (arguments.set >= 0) +  arguments.tog;
@@ -561,7 +3861,7 @@ main (int argc, char** argv)
 	}
 	
 	/* quick check to see if we can't write to file but want to */
-	int canwrite = !CheckPerm(BRIGHTNESS);
+	int canwrite = !CheckPerm(device.brightness);
 	if(!canwrite && !arguments.verbose && !arguments.iconpath)
 	{
 		printf("Unable to set brightness, check permissions. -v for more info."
@@ -569,6 +3869,8 @@ main (int argc, char** argv)
 		exit(EXIT_FAILURE);
 	}
 	
+	ProfileMark(&profile, "read");
+	
 	char *path = NULL;
 	int len = GetContainingPath(&path);
 	
@@ -578,13 +3880,38 @@ main (int argc, char** argv)
 	char cachepath[len+20];
 	sprintf(cachepath, "%sprev_brightness", path);
 
-	const char *action;
+	const char *action = "";
 	int change = 0, toggleoff = 0;
 	
+	/* toggle with bl_power: 1 to switch on, -1 to switch off */
+	int powertoggle = 0, poweron = 0;
+	
 	/* for all my percentifying needs */
 	double percentifier = 100/(double)max_brightness;
 	
-	if (arguments.tog)
+	MetricAdd(&metrics->requests[arguments.tog        ? REQ_TOGGLE
+	                             : arguments.inc >= 0 ? REQ_INC
+	                             : arguments.dec >= 0 ? REQ_DEC
+	                             : arguments.set >= 0 ? REQ_SET
+	                                                  : REQ_READ], 1);
+	
+	/* as whoever we run as, which access() would not check under setuid */
+	int haspower = !faccessat(AT_FDCWD, device.bl_power, W_OK, AT_EACCESS);
+	
+	if (arguments.tog && brightness > 0 && haspower)
+	{
+		if (ReadSysFile(device.bl_power) != BL_POWER_ON)
+		{
+			powertoggle = 1;
+			action = "Toggled on at ";
+		}
+		else
+		{
+			powertoggle = -1;
+			action = "Toggled off, kept brightness at ";
+		}
+	}
+	else if (arguments.tog)
 	{
 		if (brightness == 0)
 		{
@@ -592,6 +3919,9 @@ main (int argc, char** argv)
 			if(change < 1)
 				change  = 1;
 			action = "Toggled on, set to ";
+			/* switched off at 0 through bl_power, switch it back on too */
+			if(haspower && ReadSysFile(device.bl_power) != BL_POWER_ON)
+				poweron = 1;
 		}
 		else
 		{
@@ -638,19 +3968,20 @@ main (int argc, char** argv)
 	
 	char *func = (char*) malloc(60);
 	sprintf(func, "%s%i", action,
-	        ((arguments.set > -1) ? brightness
-	                              : abs(change)));
+	        ((arguments.set > -1 || powertoggle) ? brightness
+	                                             : abs(change)));
 	if(arguments.percent)
 		sprintf(func, "%s (%i%%)", func, 
-		        (int)ceil(percentifier*((arguments.set > -1) ? brightness
-		                                                     : abs(change))));
+		        (int)ceil(percentifier*((arguments.set > -1 || powertoggle)
+		                                ? brightness : abs(change))));
 	
 	/* calculate icon path and send notification if needed */
 	if(arguments.verbose || arguments.notify || arguments.iconpath)
 	{
 		char iconpath[len+40];
 		const char *icon = NULL;
-		int x = (int)round(4.4*(double)brightness/max_brightness);
+		int x = powertoggle < 0 ? 0
+		      : (int)round(4.4*(double)brightness/max_brightness);
 		switch(x)
 		{
 			case 0: icon = "off";	break;
@@ -666,7 +3997,7 @@ main (int argc, char** argv)
 			printf(iconpath);
 			
 		/* only send notification if brightness will be changed */
-		if (canwrite && change)
+		if (canwrite && (change || powertoggle))
 		{
 			if(arguments.notify)
 			{
@@ -675,7 +4006,10 @@ main (int argc, char** argv)
 				                "-h int:value:%i -h string:synchronous:"
 				                "brightness \"Brightness %s\"",
 				        iconpath, (int)round(brightness*percentifier), func);
+				struct timespec start;
+				clock_gettime(CLOCK_MONOTONIC, &start);
 				system(notify);
+				HistogramObserve(&metrics->notification, ElapsedUs(&start));
 			}
 		}
 		if (arguments.verbose)
@@ -684,17 +4018,61 @@ main (int argc, char** argv)
 			printf("Icon path = %s\n",iconpath);
 		}
 	}
+	ProfileMark(&profile, "notify");
+	
 	/* try to write new brightness */
 	int chars = canwrite ? 0 : -1;
-	if(canwrite && (change || arguments.verbose))
+	if(canwrite && powertoggle)
+	{
+		chars = SetPower(&device, powertoggle > 0, brightness);
+	}
+	else if(canwrite && poweron)
+	{
+		/* a fade would not show with the panel off, set it and switch on */
+		chars = SetBrightness(&device, brightness);
+		if(chars >= 0)
+			chars = SetPower(&device, 1, brightness);
+	}
+	else if(canwrite && (change || arguments.verbose))
 	{
-		chars = FadeTo(BRIGHTNESS, prev_brightness, change);
+		chars = FadeTo(&device, prev_brightness, change);
+		
+		/* someone else changed the level mid fade, report what they set */
+		if(device.yielded && device.observed >= 0)
+		{
+			brightness = device.observed;
+			change = brightness - prev_brightness;
+			sprintf(func, "Gave way to an external change to %i", brightness);
+			/* and toggling back on from off returns to it */
+			if(brightness > 0)
+				SetTo(cachepath, brightness);
+		}
 	}
 	
-	SetLock(F_UNLCK);
+	ProfileMark(&profile, "write");
+	
+	if(arguments.record && totalNonPassive)
+		RecordRequest(arguments.record, &arrival, prev_brightness,
+		              ReadSysFile(device.brightness));
+	
+	SetLock(&device, F_UNLCK);
+	
+	/* for backlight-restore to put back at boot, but never a dark screen */
+	if(chars >= 0 && (change || powertoggle) && brightness > 0)
+		SaveCurrent(&device);
+	
+	if(chars < 0)
+		MetricAdd(&metrics->errors[chars == -1 ? ERR_OPEN
+		                         : chars == -3 ? ERR_SLEEP
+		                                       : ERR_WRITE], 1);
+	if(arguments.metrics && WriteMetrics(arguments.metrics, metrics) < 0
+	&& !arguments.quiet)
+		printf("Couldn't write metrics to %s\n", arguments.metrics);
 	
 	if(arguments.quiet)
 	{
+		if(arguments.profile)
+			ProfilePrint(&profile);
 		free(func);
 		free(path);
 		return chars < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
@@ -734,7 +4112,7 @@ main (int argc, char** argv)
 		{
 			printf("Cannot write to %s\nMake sure %sbrightness is owned by "
 			       "root.\nIf so, try \"sudo chmod u+s %sbrightness\"\n",
-			       BRIGHTNESS, path, path);
+			       device.brightness, path, path);
 		}
 		else if(chars == -2)
 		{
@@ -743,6 +4121,7 @@ main (int argc, char** argv)
 		else
 		{
 			printf("Characters written = %i\n", chars);
+			printf("Writes elided = %lu\n", device.elided);
 			printf("%s\n", func);
 		}
 	}
@@ -775,6 +4154,8 @@ main (int argc, char** argv)
 			 || arguments.dec > 0)
 			printf("Reached minimum brightness, -t to turn off\n");
 	}
+	if(arguments.profile)
+		ProfilePrint(&profile);
 	free(func);
 	free(path);
 	
@@ -0,0 +1,185 @@
+/**
+ *
+ * @file restore.c
+ *
+ * @section Introduction
+ * Put the backlight back at the level backlight last saved for it, early
+ * in boot, before anything else has had a chance to touch it.
+ *
+ * This is kept apart from backlight so it carries nothing it does not
+ * need: no argp, no libm, no notifications, no stdio on the restore path.
+ * A restore is one read of the saved level and one write of it to the
+ * device.
+ *
+ * @copyright
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section Usage
+ * backlight-restore [DIR] [--bench N]
+ *
+ * DIR is the device directory, as given to backlight -D. --bench restores
+ * N times and reports what each one cost.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+
+/* these must match brightness.c, which saves the levels */
+#define DEVICE_DIR "/sys/class/backlight/intel_backlight/"
+#define STATE_DIR "/var/lib/backlight/"
+
+static int
+StatePath(const char *dir, char *path, size_t size)
+{
+	/**
+	 * Work out the name of the file holding the saved level of a device,
+	 * the same way backlight does: STATE_DIR followed by where the device
+	 * directory resolves to, with each / turned into _.
+	 *
+	 * @param[in]  *dir  The device directory
+	 * @param[out] *path Where to put the name
+	 * @param[in]  size  The size of path
+	 *
+	 * @return           0 is success; -1 if dir does not resolve or the
+	 *                   name does not fit
+	 */
+	
+	char real[PATH_MAX];
+	if(!realpath(dir, real))
+		return -1;
+	dir = real;
+	size_t len = strlen(STATE_DIR), i;
+	size_t dirlen = strlen(dir);
+	
+	while(dirlen > 1 && dir[dirlen-1] == '/')
+		dirlen--;
+	if(len + dirlen + 1 > size)
+		return -1;
+	memcpy(path, STATE_DIR, len);
+	for(i = 0; i < dirlen; i++)
+		path[len++] = dir[i] == '/' ? '_' : dir[i];
+	path[len] = '\0';
+	return 0;
+}
+
+static int
+Restore(const char *state, const char *brightness)
+{
+	/**
+	 * Write the saved level to the device. The text saved is written as it
+	 * is, so the level is never converted, and a level of 0, which would
+	 * leave the screen dark, is not restored.
+	 *
+	 * @param[in] *state      The name of the file holding the saved level
+	 * @param[in] *brightness The name of the device's brightness file
+	 *
+	 * @return                0 is success; -1 if nothing was saved; -2 if
+	 *                        the device could not be written
+	 */
+	
+	char level[16];
+	ssize_t len, i;
+	
+	int fd = open(state, O_RDONLY|O_CLOEXEC);
+	if(fd == -1)
+		return -1;
+	len = read(fd, level, sizeof(level));
+	close(fd);
+	
+	/* only digits and a newline, and not just zeroes */
+	int lit = 0;
+	for(i = 0; i < len && level[i] != '\n'; i++)
+	{
+		if(level[i] < '0' || level[i] > '9')
+			return -1;
+		lit |= level[i] != '0';
+	}
+	if(!lit)
+		return -1;
+	
+	fd = open(brightness, O_WRONLY|O_CLOEXEC);
+	if(fd == -1)
+		return -2;
+	i = write(fd, level, len);
+	close(fd);
+	return i == len ? 0 : -2;
+}
+
+int
+main(int argc, char **argv)
+{
+	/**
+	 * Restore the level of the device given, or of DEVICE_DIR, and with
+	 * --bench N do it N times and report the average wall and CPU time
+	 *
+	 * @return EXIT_SUCCESS if the level was restored
+	 */
+	
+	const char *dir = DEVICE_DIR;
+	char state[PATH_MAX], brightness[PATH_MAX];
+	long runs = 0, i;
+	
+	for(i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "--bench") && i+1 < argc)
+			runs = atol(argv[++i]);
+		else if(argv[i][0] != '-')
+			dir = argv[i];
+		else
+		{
+			fprintf(stderr, "Usage: %s [DIR] [--bench N]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	size_t len = strlen(dir);
+	if(StatePath(dir, state, sizeof(state))
+	|| len + sizeof("brightness") + 1 > sizeof(brightness))
+		return EXIT_FAILURE;
+	memcpy(brightness, dir, len);
+	if(len && dir[len-1] != '/')
+		brightness[len++] = '/';
+	strcpy(brightness + len, "brightness");
+	
+	if(runs < 1)
+		return Restore(state, brightness) ? EXIT_FAILURE : EXIT_SUCCESS;
+	
+	struct timespec start, end, cpustart, cpuend;
+	int result = 0;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpustart);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < runs && !result; i++)
+		result = Restore(state, brightness);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuend);
+	
+	if(result)
+	{
+		fprintf(stderr, "Restore failed: %s\n", result == -1
+		        ? "nothing saved" : "could not write the device");
+		return EXIT_FAILURE;
+	}
+	printf("%ld restores of %s from %s\n", runs, brightness, state);
+	printf("Wall time = %ld ns each\n",
+	       ((end.tv_sec - start.tv_sec)*1000000000L
+	      + (end.tv_nsec - start.tv_nsec))/runs);
+	printf("CPU time = %ld ns each\n",
+	       ((cpuend.tv_sec - cpustart.tv_sec)*1000000000L
+	      + (cpuend.tv_nsec - cpustart.tv_nsec))/runs);
+	return EXIT_SUCCESS;
+}